@@ -2,129 +2,1996 @@
 #include<chrono>
 #include<mutex>
 #include<shared_mutex>
+#include<condition_variable>
 #include<unordered_map>
+#include<queue>
+#include<vector>
 #include<thread>
 #include<memory>
+#include<atomic>
+#include<random>
+#include<string>
+#include<string_view>
+#include<cstring>
+#include<cstdio>
+#include<unistd.h>
+#include<sys/wait.h>
+#include<fcntl.h>
+#include<filesystem>
+#include<algorithm>
+#include<optional>
+#include<charconv>
+#include<bit>
+#include<cmath>
+#ifdef __APPLE__
+#include<mach/mach.h>
+#endif
 
 using namespace std;
 
+// read-only, ref-counted view of a stored value; stays valid after the key is overwritten or deleted
+using ValueHandle = shared_ptr<const string>;
+
+// epoch based reclamation: a reader announces the epoch it started in, a writer that unlinks
+// an object retires it, and the object is freed only once every reader that might still
+// hold a pointer to it has left. Readers never block and never write shared cache lines.
+class EpochDomain {
+public:
+    static constexpr size_t maxThreads = 1024;
+
+private:
+    static constexpr uint64_t idle = UINT64_MAX;
+
+    struct alignas(64) Slot {
+        atomic<uint64_t> epoch{idle};
+        atomic<bool> inUse{false};
+    };
+
+    struct Retired {
+        void *ptr;
+        void (*deleter)(void*);
+        uint64_t epoch;
+    };
+
+    struct ThreadState {
+        size_t slot = maxThreads;
+        int depth = 0;
+        vector<Retired> retired;
+
+        ~ThreadState() {
+            if(slot == maxThreads) return;
+            EpochDomain &domain = instance();
+            domain.reclaim(retired);
+            {
+                lock_guard<mutex> lock(domain.orphanMux);
+                domain.orphans.insert(domain.orphans.end(), retired.begin(), retired.end());
+            }
+            domain.slots[slot].epoch.store(idle, memory_order_release);
+            domain.slots[slot].inUse.store(false, memory_order_release);
+        }
+    };
+
+    Slot slots[maxThreads];
+    atomic<uint64_t> globalEpoch{1};
+
+    // left behind by threads that exited with objects still waiting
+    mutex orphanMux;
+    vector<Retired> orphans;
+
+    ThreadState& local() {
+        thread_local ThreadState state;
+        while(state.slot == maxThreads) {
+            for(size_t i = 0; i < maxThreads; i++) {
+                bool expected = false;
+                if(!slots[i].inUse.load(memory_order_relaxed) && slots[i].inUse.compare_exchange_strong(expected, true)) {
+                    state.slot = i;
+                    break;
+                }
+            }
+            if(state.slot == maxThreads) this_thread::yield();
+        }
+        return state;
+    }
+
+    // frees everything retired before the oldest epoch still announced by a reader
+    void reclaim(vector<Retired> &retired) {
+        globalEpoch.fetch_add(1, memory_order_seq_cst);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        uint64_t oldest = idle;
+        for(Slot &slot : slots) oldest = min(oldest, slot.epoch.load(memory_order_acquire));
+
+        size_t kept = 0;
+        for(Retired &r : retired) {
+            if(r.epoch < oldest) r.deleter(r.ptr);
+            else retired[kept++] = r;
+        }
+        retired.resize(kept);
+    }
+
+public:
+    // runs at process exit, when no reader is left
+    ~EpochDomain() {
+        for(Retired &r : orphans) r.deleter(r.ptr);
+    }
+
+    static EpochDomain& instance() {
+        static EpochDomain domain;
+        return domain;
+    }
+
+    // small dense id for the calling thread, handy for per-thread counters
+    size_t threadIndex() { return local().slot; }
+
+    void enter() {
+        ThreadState &state = local();
+        if(state.depth++ > 0) return;
+        slots[state.slot].epoch.store(globalEpoch.load(memory_order_seq_cst), memory_order_relaxed);
+        // the announcement must be visible before any shared pointer is read
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+
+    void exit() {
+        ThreadState &state = local();
+        if(--state.depth > 0) return;
+        slots[state.slot].epoch.store(idle, memory_order_release);
+    }
+
+    // call after the object is unreachable for new readers
+    template <typename T>
+    void retire(T *ptr) {
+        ThreadState &state = local();
+        atomic_thread_fence(memory_order_seq_cst);
+        state.retired.push_back(Retired{ptr, [](void *p) { delete static_cast<T*>(p); }, globalEpoch.load(memory_order_seq_cst)});
+
+        if(state.retired.size() >= 128) {
+            reclaim(state.retired);
+            unique_lock<mutex> lock(orphanMux, try_to_lock);
+            if(lock.owns_lock() && !orphans.empty()) reclaim(orphans);
+        }
+    }
+};
+
+struct EpochGuard {
+    EpochGuard() { EpochDomain::instance().enter(); }
+    ~EpochGuard() { EpochDomain::instance().exit(); }
+};
+
+// immutable version of an item's value; a write publishes a new one instead of editing in place,
+// so readers can use it without a lock
+struct ItemState {
+    ValueHandle value;
+    int64_t version;
+    chrono::steady_clock::time_point updatedAt;
+    chrono::seconds ttl;
+    chrono::steady_clock::time_point expireAt;
+};
+
 class DataItem {
 public:
-    string key;
-    string value;
-    int64_t version;
-    chrono::steady_clock::time_point createdAt;
-    chrono::steady_clock::time_point updatedAt;
+    string key;
+    size_t hash;
+    chrono::steady_clock::time_point createdAt;
+    atomic<ItemState*> state;
+
+    // writer side only: readers never touch these or the mutex
+    // expiry the item is currently filed under in the shard's expiryMinHeap
+    chrono::steady_clock::time_point scheduledAt;
+    mutex mux;
+
+    // bytes counted against the memory budget, and the CLOCK bit set by reads
+    int64_t charge = 0;
+    atomic<bool> referenced{true};
+
+    DataItem(string k, size_t hash, ValueHandle v, chrono::seconds ttl, int64_t version): 
+        key(k), 
+        hash(hash), 
+        createdAt(chrono::steady_clock::now()),
+        state(new ItemState{move(v), version, createdAt, ttl, createdAt + ttl}),
+        scheduledAt(createdAt + ttl) {}
+
+    ~DataItem() { delete state.load(memory_order_relaxed); }
+
+    // caller holds mux, or the shard lock exclusively
+    void publish(ValueHandle value, chrono::seconds ttl, int64_t version) {
+        ItemState *old = state.load(memory_order_relaxed);
+        auto now = chrono::steady_clock::now();
+        state.store(new ItemState{move(value), version, now, ttl, now + ttl}, memory_order_release);
+        EpochDomain::instance().retire(old);
+    }
+};
+
+// chained hash index whose lookups run without locks; inserts and removals need the
+// shard lock exclusively. Growing copies the chain nodes into a new bucket array, so a
+// reader still walking the old array keeps seeing a consistent (if slightly stale) chain.
+class ItemIndex {
+    struct Node {
+        DataItem *item;
+        atomic<Node*> next;
+    };
+
+    struct Buckets {
+        size_t mask;
+        unique_ptr<atomic<Node*>[]> heads;
+
+        Buckets(size_t count): mask(count - 1), heads(new atomic<Node*>[count]) {
+            for(size_t i = 0; i < count; i++) heads[i].store(nullptr, memory_order_relaxed);
+        }
+    };
+
+    atomic<Buckets*> buckets;
+    size_t count = 0;
+
+    void grow() {
+        Buckets *old = buckets.load(memory_order_relaxed);
+        Buckets *bigger = new Buckets((old->mask + 1) * 2);
+
+        vector<Node*> copied;
+        copied.reserve(count);
+        for(size_t b = 0; b <= old->mask; b++) {
+            for(Node *n = old->heads[b].load(memory_order_relaxed); n; n = n->next.load(memory_order_relaxed)) {
+                atomic<Node*> &head = bigger->heads[n->item->hash & bigger->mask];
+                head.store(new Node{n->item, head.load(memory_order_relaxed)}, memory_order_relaxed);
+                copied.push_back(n);
+            }
+        }
+
+        // readers can reach the old nodes until bigger is published, so they are retired after
+        buckets.store(bigger, memory_order_release);
+        for(Node *n : copied) EpochDomain::instance().retire(n);
+        EpochDomain::instance().retire(old);
+    }
+
+public:
+    ItemIndex(): buckets(new Buckets(16)) {}
+
+    ~ItemIndex() {
+        Buckets *b = buckets.load(memory_order_relaxed);
+        for(size_t i = 0; i <= b->mask; i++) {
+            for(Node *n = b->heads[i].load(memory_order_relaxed); n; ) {
+                Node *next = n->next.load(memory_order_relaxed);
+                delete n->item;
+                delete n;
+                n = next;
+            }
+        }
+        delete b;
+    }
+
+    // readers call it inside an EpochGuard
+    DataItem* find(string_view key, size_t hash) const {
+        Buckets *b = buckets.load(memory_order_acquire);
+        for(Node *n = b->heads[hash & b->mask].load(memory_order_acquire); n; n = n->next.load(memory_order_acquire)) {
+            if(n->item->hash == hash && n->item->key == key) return n->item;
+        }
+        return nullptr;
+    }
+
+    void insert(DataItem *item) {
+        if(count >= (buckets.load(memory_order_relaxed)->mask + 1)) grow();
+
+        Buckets *b = buckets.load(memory_order_relaxed);
+        atomic<Node*> &head = b->heads[item->hash & b->mask];
+        head.store(new Node{item, head.load(memory_order_relaxed)}, memory_order_release);
+        count++;
+    }
+
+    // unlinks and returns the item, the caller retires it
+    DataItem* remove(string_view key, size_t hash) {
+        Buckets *b = buckets.load(memory_order_relaxed);
+        atomic<Node*> *link = &b->heads[hash & b->mask];
+
+        for(Node *n = link->load(memory_order_relaxed); n; n = link->load(memory_order_relaxed)) {
+            if(n->item->hash == hash && n->item->key == key) {
+                DataItem *item = n->item;
+                link->store(n->next.load(memory_order_relaxed), memory_order_release);
+                // the writer holds no epoch, so n may be freed right away
+                EpochDomain::instance().retire(n);
+                count--;
+                return item;
+            }
+            link = &n->next;
+        }
+        return nullptr;
+    }
+
+    size_t size() const { return count; }
+    size_t bucketCount() const { return buckets.load(memory_order_relaxed)->mask + 1; }
+
+    template <typename F>
+    void forEachInBucket(size_t bucket, F &&f) const {
+        Buckets *b = buckets.load(memory_order_acquire);
+        for(Node *n = b->heads[bucket & b->mask].load(memory_order_acquire); n; n = n->next.load(memory_order_acquire)) f(n->item);
+    }
+
+    template <typename F>
+    void forEach(F &&f) const {
+        Buckets *b = buckets.load(memory_order_acquire);
+        for(size_t i = 0; i <= b->mask; i++) forEachInBucket(i, f);
+    }
+};
+
+struct ExpiryItem {
+    chrono::steady_clock::time_point expireAt;
+    string key;
+
+    bool operator>(const ExpiryItem& other) const {
+        return expireAt > other.expireAt;
+    }
+};
+
+// one hash partition of the key space, with its own lock
+// aligned so that two shard locks never share a cache line
+// readers go through the index without the lock; writers take it shared to update an item
+// (plus the item's mutex) and exclusively to insert or remove one
+struct alignas(64) KvShard {
+    ItemIndex index;
+    shared_mutex mux;
+
+    // keys ordered by expiry, so cleanup only touches what is due
+    priority_queue<ExpiryItem, vector<ExpiryItem>, greater<ExpiryItem>> expiryMinHeap;
+    mutex expiryMux;
+
+    void scheduleExpiry(string_view key, chrono::steady_clock::time_point expireAt) {
+        lock_guard<mutex> lock(expiryMux);
+        expiryMinHeap.push(ExpiryItem{expireAt, string(key)});
+    }
+
+    // versions come from one counter per shard rather than per item, so a key that is
+    // deleted and written again never repeats a version a client may still hold
+    atomic<int64_t> lastVersion{0};
+    int64_t nextVersion() { return lastVersion.fetch_add(1, memory_order_relaxed) + 1; }
+
+    // bytes charged for this shard's items and the CLOCK hand over its buckets
+    atomic<int64_t> usedBytes{0};
+    size_t clockHand = 0;
+
+    // on their own cache line so that bumping them does not bounce the lock
+    alignas(64) atomic<uint64_t> evictions{0};
+    atomic<uint64_t> expirations{0};
+
+    // rough footprint of an entry: the key, the value, and the DataItem, ItemState,
+    // index node, control block and expiry heap entry around them
+    static int64_t entryBytes(size_t keyLen, size_t valueLen) {
+        return keyLen + valueLen + sizeof(DataItem) + sizeof(ItemState) + 160;
+    }
+
+    // caller holds mux, plus item.mux if mux is only shared
+    void charge(DataItem &item, int64_t bytes) {
+        usedBytes.fetch_add(bytes - item.charge, memory_order_relaxed);
+        item.charge = bytes;
+    }
+
+    // caller holds mux exclusively
+    void insert(DataItem *item) {
+        charge(*item, entryBytes(item->key.size(), item->state.load(memory_order_relaxed)->value->size()));
+        index.insert(item);
+    }
+
+    // caller holds mux exclusively; false if the key was not there
+    bool erase(string_view key, size_t hash) {
+        DataItem *item = index.remove(key, hash);
+        if(!item) return false;
+        usedBytes.fetch_sub(item->charge, memory_order_relaxed);
+        EpochDomain::instance().retire(item);
+        return true;
+    }
+};
+
+// get/mget hit and miss counts, one cache line per thread so the read path never shares one
+struct alignas(64) ReadCounters {
+    atomic<uint64_t> hits{0};
+    atomic<uint64_t> misses{0};
+};
+
+// a value with the version to pass to compareAndSet; version 0 means the key is missing
+struct VersionedValue {
+    ValueHandle value;
+    int64_t version = 0;
+};
+
+struct KvStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t expirations = 0;
+    int64_t usedBytes = 0;
+    size_t keys = 0;
+};
+
+enum class FsyncPolicy {
+    Always,         // put/delete returns only after its record is fsynced
+    EveryInterval,  // fsync once per flush interval, a crash loses at most one interval
+    Never           // leave it to the OS page cache
+};
+
+struct PersistenceOptions {
+    string dir;
+    FsyncPolicy fsyncPolicy = FsyncPolicy::EveryInterval;
+    chrono::milliseconds flushInterval = chrono::milliseconds(1000);
+    chrono::seconds snapshotInterval = chrono::seconds(300);
+};
+
+// log and snapshot records:
+// [op:1][keyLen:4][valueLen:4][expireAt:8][key][value][checksum:4]
+// expireAt is wall clock ms in the log and remaining ttl ms in snapshots
+enum class RecordOp : uint8_t { Put = 1, Delete = 2 };
+
+struct LogRecord {
+    RecordOp op;
+    string key;
+    string value;
+    int64_t expireAt;
+};
+
+uint32_t checksumOf(const char *data, size_t len) {
+    // FNV-1a, enough to spot a torn tail after a crash
+    uint32_t h = 2166136261u;
+    for(size_t i = 0; i < len; i++) h = (h ^ (uint8_t)data[i]) * 16777619u;
+    return h;
+}
+
+void encodeRecord(string &buf, RecordOp op, string_view key, string_view value, int64_t expireAt) {
+    size_t start = buf.size();
+    uint32_t keyLen = key.size(), valueLen = value.size();
+
+    buf.push_back((char)op);
+    buf.append((const char*)&keyLen, sizeof(keyLen));
+    buf.append((const char*)&valueLen, sizeof(valueLen));
+    buf.append((const char*)&expireAt, sizeof(expireAt));
+    buf.append(key);
+    buf.append(value);
+
+    uint32_t checksum = checksumOf(buf.data() + start, buf.size() - start);
+    buf.append((const char*)&checksum, sizeof(checksum));
+}
+
+// stops at the first torn or corrupt record
+vector<LogRecord> decodeRecords(const string &buf) {
+    const size_t headerSize = 1 + 4 + 4 + 8;
+    vector<LogRecord> records;
+    size_t pos = 0;
+
+    while(pos + headerSize <= buf.size()) {
+        uint32_t keyLen, valueLen;
+        int64_t expireAt;
+        memcpy(&keyLen, buf.data() + pos + 1, 4);
+        memcpy(&valueLen, buf.data() + pos + 5, 4);
+        memcpy(&expireAt, buf.data() + pos + 9, 8);
+
+        size_t bodySize = headerSize + (size_t)keyLen + valueLen;
+        if(pos + bodySize + 4 > buf.size()) break;
+
+        uint32_t checksum;
+        memcpy(&checksum, buf.data() + pos + bodySize, 4);
+        if(checksum != checksumOf(buf.data() + pos, bodySize)) break;
+
+        LogRecord record;
+        record.op = (RecordOp)buf[pos];
+        record.key.assign(buf.data() + pos + headerSize, keyLen);
+        record.value.assign(buf.data() + pos + headerSize + keyLen, valueLen);
+        record.expireAt = expireAt;
+        records.push_back(move(record));
+
+        pos += bodySize + 4;
+    }
+    return records;
+}
+
+string readFile(const string &path) {
+    string buf;
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) return buf;
+
+    char chunk[1 << 16];
+    ssize_t n;
+    while((n = read(fd, chunk, sizeof(chunk))) > 0) buf.append(chunk, n);
+    close(fd);
+    return buf;
+}
+
+// writes the whole buffer, fsyncs and renames into place so readers never see a partial file
+bool writeFileAtomically(const string &path, const string &buf) {
+    string tmpPath = path + ".tmp";
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) return false;
+
+    size_t done = 0;
+    while(done < buf.size()) {
+        ssize_t n = write(fd, buf.data() + done, buf.size() - done);
+        if(n <= 0) { close(fd); return false; }
+        done += n;
+    }
+    fsync(fd);
+    close(fd);
+    return rename(tmpPath.c_str(), path.c_str()) == 0;
+}
+
+int64_t wallClockMs() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// append-only log of puts and deletes; callers buffer records under the mutex and a
+// single flusher thread writes and fsyncs whatever has piled up, so concurrent writers
+// share one fsync (group commit). Only the flusher touches the file descriptor.
+class WriteAheadLog {
+    int fd = -1;
+    FsyncPolicy policy;
+    chrono::milliseconds flushInterval;
+
+    string pending;
+    uint64_t appendedSeq = 0;
+    uint64_t durableSeq = 0;
+    mutex mux;
+    condition_variable flushCv;
+    condition_variable durableCv;
+
+    // handed from rotate() to the flusher: the old file's tail and the file to continue in
+    bool rotating = false;
+    string rotateTail;
+    string rotatePath;
+    uint64_t rotateSeq = 0;
+
+    thread flushThread;
+    bool shutDownFlag = false;
+
+    // errno of the first failed write, fsync or open. From then on nothing more is written,
+    // since later records would sit behind a gap, and waitDurable fails.
+    int error = 0;
+
+    static bool writeAll(int fd, const string &buf) {
+        size_t done = 0;
+        while(done < buf.size()) {
+            ssize_t n = write(fd, buf.data() + done, buf.size() - done);
+            if(n <= 0) return false;
+            done += n;
+        }
+        return true;
+    }
+
+    // flusher only, without mux; 0 or the errno of the failure
+    int writeOut(const string &buf, bool sync) {
+        if(!writeAll(fd, buf)) return errno ? errno : EIO;
+        if(sync && fsync(fd) != 0) return errno;
+        return 0;
+    }
+
+    void flushWorker() {
+        unique_lock<mutex> lock(mux);
+        while(true) {
+            if(policy == FsyncPolicy::Always) flushCv.wait(lock, [&]{return shutDownFlag || rotating || !pending.empty();});
+            else flushCv.wait_for(lock, flushInterval, [&]{return shutDownFlag || rotating;});
+
+            if(rotating) {
+                string tail;
+                tail.swap(rotateTail);
+                bool isFailed = error != 0;
+                lock.unlock();
+
+                int err = isFailed ? 0 : writeOut(tail, true);
+                if(fd >= 0) close(fd);
+                fd = -1;
+                if(!isFailed && !err) {
+                    fd = open(rotatePath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+                    if(fd < 0) err = errno;
+                }
+
+                lock.lock();
+                if(err) error = err;
+                else if(!error) durableSeq = max(durableSeq, rotateSeq);
+                rotating = false;
+                durableCv.notify_all();
+                continue;
+            }
+
+            if(error) pending.clear();
+            if(pending.empty()) {
+                if(shutDownFlag) return;
+                continue;
+            }
+
+            string batch;
+            batch.swap(pending);
+            uint64_t batchSeq = appendedSeq;
+            lock.unlock();
+
+            int err = writeOut(batch, policy != FsyncPolicy::Never);
+
+            lock.lock();
+            if(err) error = err;
+            else durableSeq = batchSeq;
+            durableCv.notify_all();
+        }
+    }
+
+public:
+    WriteAheadLog(const string &path, FsyncPolicy policy, chrono::milliseconds flushInterval):
+        policy(policy),
+        flushInterval(flushInterval) {
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if(fd < 0) error = errno;
+        flushThread = thread(&WriteAheadLog::flushWorker, this);
+    }
+
+    ~WriteAheadLog() {
+        {
+            lock_guard<mutex> lock(mux);
+            shutDownFlag = true;
+        }
+        flushCv.notify_all();
+        flushThread.join();
+        if(fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+    }
+
+    // only meaningful right after construction, see hasFailed
+    bool isOpen() const { return fd >= 0; }
+
+    bool hasFailed() {
+        lock_guard<mutex> lock(mux);
+        return error != 0;
+    }
+
+    // returns the sequence number to pass to waitDurable; a failed log drops the record
+    uint64_t append(RecordOp op, string_view key, string_view value, int64_t expireAt) {
+        lock_guard<mutex> lock(mux);
+        if(!error) encodeRecord(pending, op, key, value, expireAt);
+        if(policy == FsyncPolicy::Always) flushCv.notify_one();
+        return ++appendedSeq;
+    }
+
+    // only blocks under FsyncPolicy::Always; call it after releasing any store locks.
+    // false if the log failed before seq got to disk
+    bool waitDurable(uint64_t seq) {
+        unique_lock<mutex> lock(mux);
+        if(policy == FsyncPolicy::Always) durableCv.wait(lock, [&]{return durableSeq >= seq || error;});
+        return durableSeq >= seq || !error;
+    }
+
+    // every record appended before this call ends up in the old file, every later one in
+    // newPath; false if that could not be done
+    bool rotate(const string &newPath) {
+        unique_lock<mutex> lock(mux);
+        rotateTail.swap(pending);
+        rotatePath = newPath;
+        rotateSeq = appendedSeq;
+        rotating = true;
+        flushCv.notify_one();
+        durableCv.wait(lock, [&]{return !rotating;});
+        return !error;
+    }
+};
+
+class KvNode {
+    vector<unique_ptr<KvShard>> shards;
+
+    thread cleanupThread;
+    chrono::milliseconds cleanupInterval;
+    bool shutDownFlag = false;
+    mutex shutDownMux;
+    condition_variable shutDownCv;
+
+    // durability, off unless enablePersistence() is called
+    PersistenceOptions persistence;
+    unique_ptr<WriteAheadLog> wal;
+    uint64_t generation = 0;
+    mutex snapshotMux;
+    thread snapshotThread;
+
+    // per shard share of the memory budget, 0 means unbounded
+    atomic<int64_t> shardBudget{0};
+
+    unique_ptr<ReadCounters[]> readCounters;
+
+    static size_t hashOf(string_view key) { return hash<string_view>{}(key); }
+
+    // the index buckets on the low bits, so pick the shard from the high bits
+    KvShard& shardFor(size_t h) { return *shards[((h >> 32) ^ h) % shards.size()]; }
+
+    ReadCounters& countersForThisThread() { return readCounters[EpochDomain::instance().threadIndex()]; }
+
+    // positions of the keys that fall in each shard, in input order
+    vector<vector<size_t>> groupByShard(const vector<string_view> &keys, vector<size_t> &hashes) {
+        vector<vector<size_t>> groups(shards.size());
+        hashes.resize(keys.size());
+        for(size_t i = 0; i < keys.size(); i++) {
+            hashes[i] = hashOf(keys[i]);
+            size_t h = hashes[i];
+            groups[((h >> 32) ^ h) % shards.size()].push_back(i);
+        }
+        return groups;
+    }
+
+    // drops the keys that are still expired as of now; a put may have refreshed them meanwhile
+    void eraseIfExpired(string_view key, size_t h, chrono::steady_clock::time_point now) {
+        KvShard &shard = shardFor(h);
+        unique_lock<shared_mutex> lock(shard.mux);
+        DataItem *item = shard.index.find(key, h);
+        if(!item || now < item->state.load(memory_order_relaxed)->expireAt) return;
+
+        shard.erase(key, h);
+        shard.expirations.fetch_add(1, memory_order_relaxed);
+    }
+
+    // CLOCK over the shard's buckets: an item read since the hand last passed gets its
+    // bit cleared and is skipped, an unread one is evicted. caller holds shard.mux exclusively
+    void evictLocked(KvShard &shard) {
+        int64_t budget = shardBudget.load(memory_order_relaxed);
+        vector<DataItem*> victims;
+
+        while(budget > 0 && shard.usedBytes.load(memory_order_relaxed) > budget && shard.index.size() > 0) {
+            shard.index.forEachInBucket(shard.clockHand++, [&](DataItem *item) {
+                if(!item->referenced.exchange(false, memory_order_relaxed)) victims.push_back(item);
+            });
+
+            // a victim is only retired by its own erase, so its key is still valid when passed in
+            for(DataItem *item : victims) shard.erase(item->key, item->hash);
+            shard.evictions.fetch_add(victims.size(), memory_order_relaxed);
+            victims.clear();
+        }
+    }
+
+    bool isOverBudget(KvShard &shard) {
+        int64_t budget = shardBudget.load(memory_order_relaxed);
+        return budget > 0 && shard.usedBytes.load(memory_order_relaxed) > budget;
+    }
+
+    // called with the shard or item lock held, so the log order matches the table order
+    uint64_t logPut(string_view key, string_view value, chrono::seconds ttl) {
+        if(!wal) return 0;
+        return wal->append(RecordOp::Put, key, value, wallClockMs() + chrono::duration_cast<chrono::milliseconds>(ttl).count());
+    }
+
+    uint64_t logDelete(string_view key) {
+        if(!wal) return 0;
+        return wal->append(RecordOp::Delete, key, "", 0);
+    }
+
+    // called after the locks are released; false if the log failed before seq got to disk
+    bool waitDurable(uint64_t seq) {
+        return !wal || !seq || wal->waitDurable(seq);
+    }
+
+    string walPath(uint64_t gen) { return persistence.dir + "/wal-" + to_string(gen) + ".log"; }
+    string snapshotPath(uint64_t gen, size_t part) { return persistence.dir + "/snapshot-" + to_string(gen) + "-" + to_string(part) + ".dat"; }
+    string snapshotMetaPath() { return persistence.dir + "/snapshot.meta"; }
+
+    // applies a recovered put, expireAt is wall clock ms; does not log
+    void restore(const string &key, string value, int64_t expireAt) {
+        size_t h = hashOf(key);
+        KvShard &shard = shardFor(h);
+        int64_t remainingMs = expireAt - wallClockMs();
+        if(remainingMs <= 0) {
+            // an older live version may still be in the table
+            unique_lock<shared_mutex> lock(shard.mux);
+            shard.erase(key, h);
+            return;
+        }
+
+        auto ttl = chrono::seconds((remainingMs + 999) / 1000);
+        DataItem *item = new DataItem(key, h, make_shared<const string>(move(value)), ttl, shard.nextVersion());
+        // not yet published, so the state can still be edited in place
+        item->state.load(memory_order_relaxed)->expireAt = item->createdAt + chrono::milliseconds(remainingMs);
+        item->scheduledAt = item->state.load(memory_order_relaxed)->expireAt;
+
+        unique_lock<shared_mutex> lock(shard.mux);
+        shard.erase(key, h);
+        shard.scheduleExpiry(key, item->scheduledAt);
+        shard.insert(item);
+        evictLocked(shard);
+    }
+
+    void recover() {
+        uint64_t snapshotGen = 0;
+        size_t snapshotParts = 0;
+        {
+            string meta = readFile(snapshotMetaPath());
+            if(!meta.empty()) sscanf(meta.c_str(), "%llu %zu", (unsigned long long*)&snapshotGen, &snapshotParts);
+        }
+
+        // snapshot parts are independent, load them in parallel
+        vector<thread> loaders;
+        for(size_t part = 0; part < snapshotParts; part++) {
+            loaders.emplace_back([this, snapshotGen, part]{
+                string buf = readFile(snapshotPath(snapshotGen, part));
+                if(buf.size() < sizeof(int64_t)) return;
+
+                int64_t takenAt;
+                memcpy(&takenAt, buf.data(), sizeof(takenAt));
+                for(auto &record : decodeRecords(buf.substr(sizeof(takenAt)))) {
+                    // snapshots store the remaining ttl as of takenAt
+                    restore(record.key, move(record.value), takenAt + record.expireAt);
+                }
+            });
+        }
+        for(auto &t : loaders) t.join();
+
+        // then replay the logs written since that snapshot, oldest first
+        vector<uint64_t> logGens;
+        for(auto &entry : filesystem::directory_iterator(persistence.dir)) {
+            unsigned long long gen;
+            string name = entry.path().filename().string();
+            if(sscanf(name.c_str(), "wal-%llu.log", &gen) == 1 && gen >= snapshotGen) logGens.push_back(gen);
+        }
+        sort(logGens.begin(), logGens.end());
+
+        for(uint64_t gen : logGens) {
+            for(auto &record : decodeRecords(readFile(walPath(gen)))) {
+                if(record.op == RecordOp::Put) {
+                    restore(record.key, move(record.value), record.expireAt);
+                } else {
+                    size_t h = hashOf(record.key);
+                    KvShard &shard = shardFor(h);
+                    unique_lock<shared_mutex> lock(shard.mux);
+                    shard.erase(record.key, h);
+                }
+            }
+            generation = max(generation, gen);
+        }
+        generation = max(generation, snapshotGen);
+    }
+
+    void snapshotWorker() {
+        while(true) {
+            {
+                unique_lock<mutex> lock(shutDownMux);
+                shutDownCv.wait_for(lock, persistence.snapshotInterval, [&]{return shutDownFlag;});
+                if(shutDownFlag) return;
+            }
+            snapshot();
+        }
+    }
+
+    // lock-free lookup shared by get and getHandle: runs onHit on the live state inside
+    // the epoch, so the state cannot be freed while it is being read
+    template <typename OnHit>
+    bool readLive(string_view key, OnHit &&onHit) {
+        size_t h = hashOf(key);
+        KvShard &shard = shardFor(h);
+        ReadCounters &counters = countersForThisThread();
+        bool isExpired = false;
+        {
+            EpochGuard guard;
+            DataItem *item = shard.index.find(key, h);
+            if(item) {
+                // only write the CLOCK bit when it is clear, so hot keys stay read-only
+                if(!item->referenced.load(memory_order_relaxed)) item->referenced.store(true, memory_order_relaxed);
+
+                ItemState *state = item->state.load(memory_order_acquire);
+                if(chrono::steady_clock::now() < state->expireAt) {
+                    onHit(*state);
+                    counters.hits.store(counters.hits.load(memory_order_relaxed) + 1, memory_order_relaxed);
+                    return true;
+                }
+                isExpired = true;
+            }
+        }
+
+        counters.misses.store(counters.misses.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        // key expired, remove it from the table
+        if(isExpired) eraseIfExpired(key, h, chrono::steady_clock::now());
+        return false;
+    }
+
+    // caller holds item.mux (with shard.mux shared) or shard.mux exclusively
+    uint64_t updateLocked(KvShard &shard, DataItem &item, ValueHandle value, chrono::seconds ttl) {
+        uint64_t seq = logPut(item.key, *value, ttl);
+        shard.charge(item, KvShard::entryBytes(item.key.size(), value->size()));
+        item.publish(move(value), ttl, shard.nextVersion());
+
+        // a later expiry is picked up when the current heap entry comes due,
+        // so only a shorter ttl needs a new entry
+        auto expireAt = item.state.load(memory_order_relaxed)->expireAt;
+        if(expireAt < item.scheduledAt) {
+            item.scheduledAt = expireAt;
+            shard.scheduleExpiry(item.key, expireAt);
+        }
+        return seq;
+    }
+
+    // every write goes through here. decide sees the key's live state (nullptr if it is
+    // missing or expired) and returns the value to store, or nullptr to leave the key alone.
+    // it runs under the item mutex, or the exclusive shard lock for a new key, so writes to
+    // one key form a single linear history and nothing lands between check and store.
+    // returns the version written, 0 if decide declined; isDurable, if given, is set to
+    // false when the write is applied but its log record failed
+    template <typename Decide>
+    int64_t writeIf(string_view key, chrono::seconds ttl, Decide &&decide, bool *isDurable = nullptr) {
+        size_t h = hashOf(key);
+        KvShard &shard = shardFor(h);
+        uint64_t seq = 0;
+        int64_t version = 0;
+        {
+            // the common case, the key exists: update it under the shared lock
+            shared_lock<shared_mutex> lock(shard.mux);
+            DataItem *item = shard.index.find(key, h);
+            if(item) {
+                lock_guard<mutex> itemLock(item->mux);
+                ItemState *state = item->state.load(memory_order_relaxed);
+                ValueHandle value = decide(chrono::steady_clock::now() < state->expireAt ? state : nullptr);
+                if(!value) return 0;
+
+                seq = updateLocked(shard, *item, move(value), ttl);
+                version = item->state.load(memory_order_relaxed)->version;
+            }
+        }
+
+        if(!version) {
+            unique_lock<shared_mutex> lock(shard.mux);
+            DataItem *item = shard.index.find(key, h);
+            ItemState *state = item ? item->state.load(memory_order_relaxed) : nullptr;
+            ValueHandle value = decide(state && chrono::steady_clock::now() < state->expireAt ? state : nullptr);
+            if(!value) return 0;
+
+            if(item) {
+                // inserted by someone else since the shared lock was dropped
+                seq = updateLocked(shard, *item, move(value), ttl);
+            } else {
+                seq = logPut(key, *value, ttl);
+                item = new DataItem(string(key), h, move(value), ttl, shard.nextVersion());
+                shard.scheduleExpiry(key, item->scheduledAt);
+                shard.insert(item);
+            }
+            version = item->state.load(memory_order_relaxed)->version;
+            evictLocked(shard);
+        } else if(isOverBudget(shard)) {
+            unique_lock<shared_mutex> lock(shard.mux);
+            evictLocked(shard);
+        }
+        bool durable = waitDurable(seq);
+        if(isDurable) *isDurable = durable;
+        return version;
+    }
+
+public:
+    // shardCount = 1 keeps the old single table behaviour
+    // expired keys are reclaimed within cleanupInterval of their expiry
+    KvNode(size_t shardCount = 1, chrono::milliseconds cleanupInterval = chrono::seconds(1)):
+        cleanupInterval(cleanupInterval),
+        readCounters(new ReadCounters[EpochDomain::maxThreads]) {
+        if(shardCount == 0) shardCount = 1;
+        for(size_t i = 0; i < shardCount; i++) shards.push_back(make_unique<KvShard>());
+        cleanupThread = thread(&KvNode::cleanupWorker, this);
+    }
+
+    ~KvNode() {
+        {
+            lock_guard<mutex> lock(shutDownMux);
+            shutDownFlag = true;
+        }
+        shutDownCv.notify_all();
+        cleanupThread.join();
+        if(snapshotThread.joinable()) snapshotThread.join();
+        // flushes whatever is still buffered
+        wal.reset();
+    }
+
+    size_t shardCount() const { return shards.size(); }
+
+    // once the store is over budget, writes evict keys (CLOCK) until it is back under;
+    // the budget is split evenly across shards. 0 removes the bound
+    void setMemoryBudget(size_t bytes) {
+        shardBudget = bytes / shards.size();
+    }
+
+    KvStats stats() {
+        KvStats total;
+        for(size_t i = 0; i < EpochDomain::maxThreads; i++) {
+            total.hits += readCounters[i].hits.load(memory_order_relaxed);
+            total.misses += readCounters[i].misses.load(memory_order_relaxed);
+        }
+        for(auto &shard : shards) {
+            total.evictions += shard->evictions.load(memory_order_relaxed);
+            total.expirations += shard->expirations.load(memory_order_relaxed);
+            total.usedBytes += shard->usedBytes.load(memory_order_relaxed);
+
+            shared_lock<shared_mutex> lock(shard->mux);
+            total.keys += shard->index.size();
+        }
+        return total;
+    }
+
+    // loads the latest snapshot and logs from options.dir, then logs every put and delete
+    // from here on; call it before serving traffic. false if the log cannot be opened.
+    bool enablePersistence(const PersistenceOptions &options) {
+        persistence = options;
+        filesystem::create_directories(persistence.dir);
+        recover();
+
+        // start a fresh log so a torn tail in the last one is never appended to
+        generation += 1;
+        wal = make_unique<WriteAheadLog>(walPath(generation), persistence.fsyncPolicy, persistence.flushInterval);
+        if(!wal->isOpen()) {
+            wal.reset();
+            return false;
+        }
+        snapshotThread = thread(&KvNode::snapshotWorker, this);
+        return true;
+    }
+
+    // writes one file per shard with each key's remaining ttl, then drops the logs it covers
+    void snapshot() {
+        if(!wal) return;
+        lock_guard<mutex> snapshotLock(snapshotMux);
+
+        // every mutation logged before the rotation is applied to the table by the time
+        // its shard/item lock is released, so the scan below sees it
+        // keeps the old logs if the new one cannot be started
+        uint64_t gen = ++generation;
+        if(!wal->rotate(walPath(gen))) return;
+
+        for(size_t part = 0; part < shards.size(); part++) {
+            KvShard &shard = *shards[part];
+            int64_t takenAt = wallClockMs();
+            auto now = chrono::steady_clock::now();
+
+            string buf((const char*)&takenAt, sizeof(takenAt));
+            {
+                shared_lock<shared_mutex> lock(shard.mux);
+                shard.index.forEach([&](DataItem *item) {
+                    lock_guard<mutex> itemLock(item->mux);
+                    ItemState *state = item->state.load(memory_order_acquire);
+                    if(now >= state->expireAt) return;
+                    int64_t remainingMs = chrono::duration_cast<chrono::milliseconds>(state->expireAt - now).count();
+                    encodeRecord(buf, RecordOp::Put, item->key, *state->value, remainingMs);
+                });
+            }
+            writeFileAtomically(snapshotPath(gen, part), buf);
+        }
+        writeFileAtomically(snapshotMetaPath(), to_string(gen) + " " + to_string(shards.size()) + "\n");
+
+        // older snapshots and logs are now covered by this one
+        for(auto &entry : filesystem::directory_iterator(persistence.dir)) {
+            unsigned long long fileGen;
+            size_t part;
+            string name = entry.path().filename().string();
+            bool isOld = (sscanf(name.c_str(), "wal-%llu.log", &fileGen) == 1 && fileGen < gen) ||
+                (sscanf(name.c_str(), "snapshot-%llu-%zu.dat", &fileGen, &part) == 2 && fileGen < gen);
+            if(isOld) filesystem::remove(entry.path());
+        }
+    }
+
+    // reads take no locks: the index lookup and the item's current state are both
+    // protected by the reclamation epoch instead
+    string get(string_view key) {
+        string value;
+        readLive(key, [&](const ItemState &state) { value = *state.value; });
+        return value;
+    }
+
+    // nullptr if the key is missing or expired
+    ValueHandle getHandle(string_view key) {
+        ValueHandle value;
+        readLive(key, [&](const ItemState &state) { value = state.value; });
+        return value;
+    }
+
+    // callers that own their buffer can move it in: put(key, move(buffer), ttl).
+    // the writers return false when persistence is enabled and the write did not make it
+    // into the log; it is still applied in memory
+    bool put(string_view key, string value, chrono::seconds ttl) {
+        return put(key, make_shared<const string>(move(value)), ttl);
+    }
+
+    // stores the handle itself, so a value can be shared across keys without a copy
+    bool put(string_view key, ValueHandle value, chrono::seconds ttl) {
+        bool isDurable = true;
+        writeIf(key, ttl, [&](const ItemState*) { return move(value); }, &isDurable);
+        return isDurable;
+    }
+
+    // true once the log has failed: writes since then are in memory only
+    bool persistenceFailed() { return wal && wal->hasFailed(); }
+
+    // value and version read together, so a later compareAndSet can tell whether anyone
+    // wrote in between
+    VersionedValue getWithVersion(string_view key) {
+        VersionedValue result;
+        readLive(key, [&](const ItemState &state) {
+            result.value = state.value;
+            result.version = state.version;
+        });
+        return result;
+    }
+
+    // stores newValue only if the key is still at expectedVersion; 0 expects the key to be
+    // missing. returns the new version, or 0 if the key had moved on.
+    // versions are not persisted, so they do not carry across a restart
+    int64_t compareAndSet(string_view key, int64_t expectedVersion, string newValue, chrono::seconds ttl) {
+        ValueHandle value = make_shared<const string>(move(newValue));
+        return writeIf(key, ttl, [&](const ItemState *current) {
+            int64_t version = current ? current->version : 0;
+            return version == expectedVersion ? move(value) : nullptr;
+        });
+    }
+
+    // adds delta to a value stored as a decimal integer, a missing key counts as 0, and
+    // refreshes the ttl. nullopt, and the key left alone, if the current value is not an
+    // integer or the sum would overflow
+    optional<int64_t> increment(string_view key, int64_t delta, chrono::seconds ttl) {
+        int64_t result = 0;
+        bool isInteger = true;
+        bool isOverflow = false;
+        writeIf(key, ttl, [&](const ItemState *current) -> ValueHandle {
+            int64_t base = 0;
+            if(current) {
+                const string &text = *current->value;
+                auto [end, err] = from_chars(text.data(), text.data() + text.size(), base);
+                if(err != errc() || end != text.data() + text.size()) {
+                    isInteger = false;
+                    return nullptr;
+                }
+            }
+            if(__builtin_add_overflow(base, delta, &result)) {
+                isOverflow = true;
+                return nullptr;
+            }
+            return make_shared<const string>(to_string(result));
+        });
+
+        if(!isInteger || isOverflow) return nullopt;
+        return result;
+    }
+
+    bool deleteKey(string_view key) {
+        size_t h = hashOf(key);
+        KvShard &shard = shardFor(h);
+        uint64_t seq = 0;
+        {
+            unique_lock<shared_mutex> lock(shard.mux);
+            if(!shard.index.find(key, h)) return true;
+
+            seq = logDelete(key);
+            shard.erase(key, h);
+        }
+        return waitDurable(seq);
+    }
+
+    // batch versions: every shard lock is taken once per batch instead of once per key
+
+    // results are in input order, nullptr for missing or expired keys; takes no locks
+    vector<ValueHandle> mget(const vector<string_view> &keys) {
+        vector<ValueHandle> values(keys.size());
+        vector<size_t> expired;
+        vector<size_t> hashes(keys.size());
+        auto now = chrono::steady_clock::now();
+        uint64_t hits = 0;
+
+        {
+            EpochGuard guard;
+            for(size_t i = 0; i < keys.size(); i++) {
+                hashes[i] = hashOf(keys[i]);
+                DataItem *item = shardFor(hashes[i]).index.find(keys[i], hashes[i]);
+                if(!item) continue;
+
+                if(!item->referenced.load(memory_order_relaxed)) item->referenced.store(true, memory_order_relaxed);
+
+                ItemState *state = item->state.load(memory_order_acquire);
+                if(now >= state->expireAt) {
+                    expired.push_back(i);
+                    continue;
+                }
+                values[i] = state->value;
+                hits++;
+            }
+        }
+
+        ReadCounters &counters = countersForThisThread();
+        counters.hits.store(counters.hits.load(memory_order_relaxed) + hits, memory_order_relaxed);
+        counters.misses.store(counters.misses.load(memory_order_relaxed) + keys.size() - hits, memory_order_relaxed);
+
+        for(size_t i : expired) eraseIfExpired(keys[i], hashes[i], now);
+        return values;
+    }
+
+    // later entries win when a key appears more than once
+    bool mput(vector<pair<string_view, string>> entries, chrono::seconds ttl) {
+        uint64_t seq = 0;
+        vector<string_view> keys;
+        vector<size_t> hashes;
+        for(auto &entry : entries) keys.push_back(entry.first);
+        auto groups = groupByShard(keys, hashes);
+
+        for(size_t s = 0; s < shards.size(); s++) {
+            if(groups[s].empty()) continue;
+
+            KvShard &shard = *shards[s];
+            vector<ExpiryItem> toSchedule;
+            unique_lock<shared_mutex> lock(shard.mux);
+
+            for(size_t i : groups[s]) {
+                string_view key = keys[i];
+                ValueHandle value = make_shared<const string>(move(entries[i].second));
+                seq = max(seq, logPut(key, *value, ttl));
+
+                DataItem *item = shard.index.find(key, hashes[i]);
+                if(!item) {
+                    item = new DataItem(string(key), hashes[i], move(value), ttl, shard.nextVersion());
+                    toSchedule.push_back(ExpiryItem{item->scheduledAt, item->key});
+                    shard.insert(item);
+                    continue;
+                }
+
+                shard.charge(*item, KvShard::entryBytes(key.size(), value->size()));
+                item->publish(move(value), ttl, shard.nextVersion());
+                auto expireAt = item->state.load(memory_order_relaxed)->expireAt;
+                if(expireAt < item->scheduledAt) {
+                    item->scheduledAt = expireAt;
+                    toSchedule.push_back(ExpiryItem{expireAt, string(key)});
+                }
+            }
+
+            if(!toSchedule.empty()) {
+                lock_guard<mutex> expiryLock(shard.expiryMux);
+                for(auto &e : toSchedule) shard.expiryMinHeap.push(move(e));
+            }
+            evictLocked(shard);
+        }
+        return waitDurable(seq);
+    }
+
+    bool mdelete(const vector<string_view> &keys) {
+        vector<size_t> hashes;
+        auto groups = groupByShard(keys, hashes);
+        uint64_t seq = 0;
+
+        for(size_t s = 0; s < shards.size(); s++) {
+            if(groups[s].empty()) continue;
+
+            KvShard &shard = *shards[s];
+            unique_lock<shared_mutex> lock(shard.mux);
+            for(size_t i : groups[s]) {
+                if(!shard.index.find(keys[i], hashes[i])) continue;
+
+                seq = max(seq, logDelete(keys[i]));
+                shard.erase(keys[i], hashes[i]);
+            }
+        }
+        return waitDurable(seq);
+    }
+
+    void cleanupWorker() {
+        while(true) {
+            {
+                unique_lock<mutex> lock(shutDownMux);
+                shutDownCv.wait_for(lock, cleanupInterval, [&]{return shutDownFlag;});
+                if(shutDownFlag) return;
+            }
+
+            // expire shard by shard so only one partition is locked at a time
+            for(auto &shard : shards) {
+                vector<ExpiryItem> due;
+                auto now = chrono::steady_clock::now();
+
+                {
+                    lock_guard<mutex> lock(shard->expiryMux);
+                    while(!shard->expiryMinHeap.empty() && shard->expiryMinHeap.top().expireAt <= now) {
+                        due.push_back(shard->expiryMinHeap.top());
+                        shard->expiryMinHeap.pop();
+                    }
+                }
+
+                if(due.empty()) continue;
+
+                unique_lock<shared_mutex> lock(shard->mux);
+                for(ExpiryItem &entry : due) {
+                    size_t h = hashOf(entry.key);
+                    DataItem *item = shard->index.find(entry.key, h);
+                    if(!item) continue;
+
+                    auto expireAt = item->state.load(memory_order_relaxed)->expireAt;
+                    if(now >= expireAt) {
+                        shard->erase(entry.key, h);
+                        shard->expirations.fetch_add(1, memory_order_relaxed);
+                    } else if(entry.expireAt == item->scheduledAt) {
+                        // ttl was extended since this entry was filed, re-arm at the new expiry
+                        item->scheduledAt = expireAt;
+                        shard->scheduleExpiry(entry.key, expireAt);
+                    }
+                    // otherwise the entry is stale, a newer one is already in the heap
+                }
+            }
+        }
+    }
+};
+
+// fixed size chunks carved out of 1MB slabs, memcached style
+// freed chunks go on a per class free list and are never handed back to the OS,
+// so a stale pointer into a slab always stays safe to read
+class SlabAllocator {
+    static constexpr size_t slabSize = 1 << 20;
+    // the first bytes of a free chunk are left untouched for the owner's header,
+    // the free list link is stored right after them
+    static constexpr size_t linkOffset = 16;
+
+    vector<size_t> classSizes;
+    vector<char*> freeLists;
+    vector<char*> cursor;
+    vector<size_t> remaining;
+    vector<unique_ptr<char[]>> slabs;
+
+public:
+    static constexpr size_t maxChunkSize = 1024;
 
-    chrono::seconds ttl;
-    chrono::steady_clock::time_point expireAt;
-    mutex mux;
+    SlabAllocator() {
+        // ~25% growth between classes keeps the rounding waste low
+        for(size_t size = 32; size < maxChunkSize; size = (size * 5 / 4 + 7) & ~size_t(7)) classSizes.push_back(size);
+        classSizes.push_back(maxChunkSize);
 
-    DataItem() = default;
-    DataItem(string k, string v, chrono::seconds ttl): 
-        key(k), 
-        value(v), 
-        version(1), 
-        ttl(ttl), 
-        expireAt(chrono::steady_clock::now() + ttl),
-        createdAt(chrono::steady_clock::now()) {}
+        freeLists.assign(classSizes.size(), nullptr);
+        cursor.assign(classSizes.size(), nullptr);
+        remaining.assign(classSizes.size(), 0);
+    }
+
+    // -1 if the size does not fit in the largest chunk; class sizes never change, so this
+    // needs no lock
+    int classFor(size_t bytes) const {
+        for(size_t i = 0; i < classSizes.size(); i++) if(bytes <= classSizes[i]) return i;
+        return -1;
+    }
+
+    char* allocate(int sizeClass) {
+        if(freeLists[sizeClass]) {
+            char *chunk = freeLists[sizeClass];
+            memcpy(&freeLists[sizeClass], chunk + linkOffset, sizeof(char*));
+            return chunk;
+        }
+
+        size_t size = classSizes[sizeClass];
+        if(remaining[sizeClass] < size) {
+            slabs.push_back(make_unique<char[]>(slabSize));
+            cursor[sizeClass] = slabs.back().get();
+            remaining[sizeClass] = slabSize;
+        }
+
+        char *chunk = cursor[sizeClass];
+        cursor[sizeClass] += size;
+        remaining[sizeClass] -= size;
+        return chunk;
+    }
+
+    void release(char *chunk, int sizeClass) {
+        memcpy(chunk + linkOffset, &freeLists[sizeClass], sizeof(char*));
+        freeLists[sizeClass] = chunk;
+    }
 };
 
-class KvNode {
-    unordered_map<string, shared_ptr<DataItem>> table;
+// 16 byte header, followed in the same chunk by the key bytes and then either
+// the value bytes (inline) or a pointer to a heap buffer holding the value
+struct CompactEntry {
+    uint32_t expireAt;      // seconds since the node's epoch, 0 marks a free chunk
+    // expiry the entry is currently filed under in the shard's expiryMinHeap; a heap item
+    // that does not match it is stale, left from an earlier expiry or an earlier use of the chunk
+    uint32_t scheduledAt;
+    uint32_t valueLen;
+    uint16_t keyLen;
+    int8_t sizeClass;
+    uint8_t isInline;
+
+    char* keyData() { return reinterpret_cast<char*>(this + 1); }
+    string_view key() { return string_view(keyData(), keyLen); }
+
+    char* valueData() {
+        if(isInline) return keyData() + keyLen;
+        char *external;
+        memcpy(&external, keyData() + keyLen, sizeof(char*));
+        return external;
+    }
+};
+
+struct CompactExpiryItem {
+    uint32_t expireAt;
+    CompactEntry *entry;
+
+    bool operator>(const CompactExpiryItem& other) const {
+        return expireAt > other.expireAt;
+    }
+};
+
+struct alignas(64) CompactShard {
+    // keys are views into the entry's own chunk, so each key is stored once
+    unordered_map<string_view, CompactEntry*> table;
+    SlabAllocator slabs;
+    priority_queue<CompactExpiryItem, vector<CompactExpiryItem>, greater<CompactExpiryItem>> expiryMinHeap;
     shared_mutex mux;
+};
+
+// memory lean alternative to KvNode with the same get/put/deleteKey API:
+// no shared_ptr, no per-item mutex and no separate allocations for small values,
+// the shard lock alone protects the entries
+class CompactKvNode {
+    vector<unique_ptr<CompactShard>> shards;
+    chrono::steady_clock::time_point epoch;
 
     thread cleanupThread;
+    chrono::milliseconds cleanupInterval;
     bool shutDownFlag = false;
+    mutex shutDownMux;
+    condition_variable shutDownCv;
+
+    CompactShard& shardFor(string_view key) {
+        size_t h = hash<string_view>{}(key);
+        return *shards[((h >> 32) ^ h) % shards.size()];
+    }
+
+    // starts at 1 so that a live entry never looks like a free chunk
+    uint32_t nowSeconds() {
+        return chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now() - epoch).count() + 1;
+    }
+
+    // nowSeconds() rounds down, so the expiry is rounded up: a key may outlive its ttl by up
+    // to a second, but never expires before it
+    uint32_t expiryAfter(chrono::seconds ttl) {
+        return chrono::ceil<chrono::seconds>(chrono::steady_clock::now() - epoch).count() + 1 + ttl.count();
+    }
+
+    CompactEntry* allocateEntry(CompactShard &shard, string_view key, string_view value) {
+        size_t inlineBytes = sizeof(CompactEntry) + key.size() + value.size();
+        int sizeClass = shard.slabs.classFor(inlineBytes);
+        bool isInline = sizeClass >= 0;
+        if(!isInline) sizeClass = shard.slabs.classFor(sizeof(CompactEntry) + key.size() + sizeof(char*));
+
+        CompactEntry *entry = reinterpret_cast<CompactEntry*>(shard.slabs.allocate(sizeClass));
+        entry->valueLen = value.size();
+        entry->keyLen = key.size();
+        entry->sizeClass = sizeClass;
+        entry->isInline = isInline;
+        memcpy(entry->keyData(), key.data(), key.size());
+
+        if(isInline) {
+            memcpy(entry->valueData(), value.data(), value.size());
+        } else {
+            char *external = new char[value.size()];
+            memcpy(external, value.data(), value.size());
+            memcpy(entry->keyData() + key.size(), &external, sizeof(char*));
+        }
+        return entry;
+    }
+
+    void releaseEntry(CompactShard &shard, CompactEntry *entry) {
+        if(!entry->isInline) delete[] entry->valueData();
+        entry->expireAt = 0;
+        shard.slabs.release(reinterpret_cast<char*>(entry), entry->sizeClass);
+    }
 
 public:
-    KvNode() {
-        cleanupThread = thread(&KvNode::cleanupWorker, this);
+    CompactKvNode(size_t shardCount = 1, chrono::milliseconds cleanupInterval = chrono::seconds(1)):
+        epoch(chrono::steady_clock::now()),
+        cleanupInterval(cleanupInterval) {
+        if(shardCount == 0) shardCount = 1;
+        for(size_t i = 0; i < shardCount; i++) shards.push_back(make_unique<CompactShard>());
+        cleanupThread = thread(&CompactKvNode::cleanupWorker, this);
     }
-    string get(string key) {
-        shared_ptr<DataItem> item;
+
+    ~CompactKvNode() {
         {
-            shared_lock<shared_mutex> lock(mux);
-            auto it = table.find(key);
-            if(it == table.end()) return "";
+            lock_guard<mutex> lock(shutDownMux);
+            shutDownFlag = true;
+        }
+        shutDownCv.notify_all();
+        cleanupThread.join();
 
-            item = it->second;
+        for(auto &shard : shards) {
+            for(auto &[key, entry] : shard->table) if(!entry->isInline) delete[] entry->valueData();
         }
+    }
 
+    string get(string_view key) {
+        CompactShard &shard = shardFor(key);
         bool isExpired = false;
         {
-            lock_guard<mutex> itemLock(item->mux);
-            auto now = chrono::steady_clock::now();
-            if(now >= item->expireAt) {
-                // key expired
-                isExpired = true;
-            } else return item->value;
+            shared_lock<shared_mutex> lock(shard.mux);
+            auto it = shard.table.find(key);
+            if(it == shard.table.end()) return "";
+
+            CompactEntry *entry = it->second;
+            if(nowSeconds() >= entry->expireAt) isExpired = true;
+            else return string(entry->valueData(), entry->valueLen);
         }
-        
+
         if(isExpired) {
-            // remove the key from table
-            deleteKey(key);
-            return "";
+            unique_lock<shared_mutex> lock(shard.mux);
+            auto it = shard.table.find(key);
+            if(it != shard.table.end() && nowSeconds() >= it->second->expireAt) {
+                CompactEntry *entry = it->second;
+                shard.table.erase(it);
+                releaseEntry(shard, entry);
+            }
         }
-
-        return item->value;
+        return "";
     }
 
-    void put(string key, string value, chrono::seconds ttl) {
-        shared_ptr<DataItem> item;
-        {
-            unique_lock<shared_mutex> lock(mux);
-            auto it = table.find(key);
-            if(it == table.end()) {
-                item = make_shared<DataItem>(key, value, ttl);
-                table[key] = item;
-                return;
-            } else {
-                item = it->second;
+    // false, and nothing stored, if the key is too long for a chunk (and so, for the 16 bit
+    // key length); only the value can move out of the chunk
+    bool put(string_view key, string_view value, chrono::seconds ttl) {
+        CompactShard &shard = shardFor(key);
+        if(shard.slabs.classFor(sizeof(CompactEntry) + key.size() + sizeof(char*)) < 0) return false;
+
+        uint32_t expireAt = expiryAfter(ttl);
+
+        unique_lock<shared_mutex> lock(shard.mux);
+        auto it = shard.table.find(key);
+        if(it != shard.table.end()) {
+            CompactEntry *entry = it->second;
+            uint32_t oldExpireAt = entry->expireAt;
+
+            if(entry->isInline && entry->valueLen == value.size()) {
+                // same size, overwrite in place
+                memcpy(entry->valueData(), value.data(), value.size());
+                entry->expireAt = expireAt;
+                // a later expiry is re-armed by the cleanup worker, only a shorter one needs a new heap entry
+                if(expireAt < oldExpireAt) {
+                    entry->scheduledAt = expireAt;
+                    shard.expiryMinHeap.push(CompactExpiryItem{expireAt, entry});
+                }
+                return true;
             }
+
+            // the map key views the old chunk, so it has to be re-inserted
+            shard.table.erase(it);
+            releaseEntry(shard, entry);
         }
-        
-        lock_guard<mutex> itemLock(item->mux);
-        item->value = value;
-        item->version += 1;
-        item->updatedAt = chrono::steady_clock::now();
-        item->ttl = ttl;
-        item->expireAt = chrono::steady_clock::now() + ttl;
+
+        CompactEntry *entry = allocateEntry(shard, key, value);
+        entry->expireAt = expireAt;
+        entry->scheduledAt = expireAt;
+        shard.table.emplace(entry->key(), entry);
+        shard.expiryMinHeap.push(CompactExpiryItem{expireAt, entry});
+        return true;
     }
 
-    void deleteKey(string key) {
-        unique_lock<shared_mutex> lock(mux);
-        table.erase(key);
+    void deleteKey(string_view key) {
+        CompactShard &shard = shardFor(key);
+        unique_lock<shared_mutex> lock(shard.mux);
+        auto it = shard.table.find(key);
+        if(it == shard.table.end()) return;
+
+        CompactEntry *entry = it->second;
+        shard.table.erase(it);
+        releaseEntry(shard, entry);
     }
 
     void cleanupWorker() {
-        while(!shutDownFlag) {
-            this_thread::sleep_for(chrono::seconds(10));
+        while(true) {
+            {
+                unique_lock<mutex> lock(shutDownMux);
+                shutDownCv.wait_for(lock, cleanupInterval, [&]{return shutDownFlag;});
+                if(shutDownFlag) return;
+            }
 
-            vector<string> toDelete;
-            auto now = chrono::steady_clock::now();
+            for(auto &shard : shards) {
+                uint32_t now = nowSeconds();
+                unique_lock<shared_mutex> lock(shard->mux);
 
-            {
-                shared_lock<shared_mutex> lock(mux);
-                for(const auto& [key, item] : table) {
-                    lock_guard<mutex> itemLock(item->mux);
-                    if(now >= item->expireAt) {
-                        toDelete.push_back(key);
+                while(!shard->expiryMinHeap.empty() && shard->expiryMinHeap.top().expireAt <= now) {
+                    CompactExpiryItem item = shard->expiryMinHeap.top();
+                    CompactEntry *entry = item.entry;
+                    shard->expiryMinHeap.pop();
+
+                    // the chunk may have been freed (expireAt 0), or re-filed or reused since
+                    if(entry->expireAt == 0 || entry->scheduledAt != item.expireAt) continue;
+                    if(entry->expireAt <= now) {
+                        shard->table.erase(entry->key());
+                        releaseEntry(*shard, entry);
+                    } else {
+                        entry->scheduledAt = entry->expireAt;
+                        shard->expiryMinHeap.push(CompactExpiryItem{entry->expireAt, entry});
                     }
                 }
             }
+        }
+    }
+};
+
+// multi-threaded get/put throughput, single table vs sharded table
+void runScalingBenchmark(size_t shardCount) {
+    const int keyCount = 100000;
+    const int readPercent = 90;
+    const auto runFor = chrono::milliseconds(1000);
+
+    vector<string> keys;
+    for(int i = 0; i < keyCount; i++) keys.push_back("key" + to_string(i));
+
+    int maxThreads = max(1u, thread::hardware_concurrency());
+    cout << "keys=" << keyCount << " reads=" << readPercent << "% duration=" << runFor.count() << "ms\n";
+
+    for(size_t shards : {(size_t)1, shardCount}) {
+        cout << "shards=" << shards << "\n";
+        for(int threads = 1; threads <= maxThreads; threads *= 2) {
+            KvNode kvStore(shards);
+            for(auto &key : keys) kvStore.put(key, "value", chrono::seconds(3600));
+
+            atomic<bool> stop{false};
+            vector<uint64_t> ops(threads, 0);
+            vector<thread> workers;
+
+            for(int t = 0; t < threads; t++) {
+                workers.emplace_back([&, t]{
+                    mt19937_64 rng(t + 1);
+                    uint64_t done = 0;
+                    while(!stop.load(memory_order_relaxed)) {
+                        const string &key = keys[rng() % keyCount];
+                        if((int)(rng() % 100) < readPercent) kvStore.get(key);
+                        else kvStore.put(key, "value", chrono::seconds(3600));
+                        done++;
+                    }
+                    ops[t] = done;
+                });
+            }
 
-            if(!toDelete.empty()) {
-                unique_lock<shared_mutex> lock(mux);
-                for(string &key : toDelete) {
-                    table.erase(key);
-                }
+            this_thread::sleep_for(runFor);
+            stop = true;
+            for(auto &w : workers) w.join();
+
+            uint64_t total = 0;
+            for(auto n : ops) total += n;
+            cout << "  threads=" << threads << " ops/sec=" << (uint64_t)(total * 1000.0 / runFor.count()) << "\n";
+        }
+    }
+}
+
+// put throughput with the write-ahead log off and under each fsync policy
+void runWalBenchmark(int threads) {
+    const int keyCount = 100000;
+    const string value(100, 'v');
+    const auto runFor = chrono::milliseconds(1000);
+
+    vector<string> keys;
+    for(int i = 0; i < keyCount; i++) keys.push_back("key" + to_string(i));
+
+    string baseDir = (filesystem::temp_directory_path() / ("kv-wal-bench-" + to_string(getpid()))).string();
+    cout << "threads=" << threads << " valueSize=" << value.size() << " duration=" << runFor.count() << "ms\n";
+
+    vector<pair<string, int>> configs = {
+        {"log disabled", -1},
+        {"fsync never", (int)FsyncPolicy::Never},
+        {"fsync every 10ms", (int)FsyncPolicy::EveryInterval},
+        {"fsync always", (int)FsyncPolicy::Always}
+    };
+
+    for(auto &[name, policy] : configs) {
+        filesystem::remove_all(baseDir);
+        uint64_t total = 0;
+        {
+            KvNode kvStore(16);
+            if(policy >= 0) {
+                PersistenceOptions options;
+                options.dir = baseDir;
+                options.fsyncPolicy = (FsyncPolicy)policy;
+                options.flushInterval = chrono::milliseconds(10);
+                kvStore.enablePersistence(options);
             }
+
+            atomic<bool> stop{false};
+            vector<uint64_t> ops(threads, 0);
+            vector<thread> workers;
+            for(int t = 0; t < threads; t++) {
+                workers.emplace_back([&, t]{
+                    mt19937_64 rng(t + 1);
+                    uint64_t done = 0;
+                    while(!stop.load(memory_order_relaxed)) {
+                        kvStore.put(keys[rng() % keyCount], value, chrono::seconds(3600));
+                        done++;
+                    }
+                    ops[t] = done;
+                });
+            }
+
+            this_thread::sleep_for(runFor);
+            stop = true;
+            for(auto &w : workers) w.join();
+            for(auto n : ops) total += n;
+        }
+        cout << "  " << name << ": puts/sec=" << (uint64_t)(total * 1000.0 / runFor.count()) << "\n";
+    }
+    filesystem::remove_all(baseDir);
+}
+
+size_t currentRssBytes() {
+#ifdef __APPLE__
+    mach_task_basic_info info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if(task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) != KERN_SUCCESS) return 0;
+    return info.resident_size;
+#else
+    size_t pages = 0, residentPages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if(!f) return 0;
+    if(fscanf(f, "%zu %zu", &pages, &residentPages) != 2) residentPages = 0;
+    fclose(f);
+    return residentPages * sysconf(_SC_PAGESIZE);
+#endif
+}
+
+template <typename Store>
+void reportMemoryPerKey(const char *name, int keyCount, int valueSize) {
+    string value(valueSize, 'v');
+    size_t before = currentRssBytes();
+    {
+        Store kvStore;
+        for(int i = 0; i < keyCount; i++) kvStore.put("key" + to_string(i), value, chrono::seconds(3600));
+
+        size_t after = currentRssBytes();
+        cout << name << ": " << (after - before) / keyCount << " bytes/key"
+             << " (" << (after - before) / (1 << 20) << " MB for " << keyCount << " keys)\n";
+    }
+}
+
+// each engine runs in its own child process so that neither inherits the other's heap
+void runMemoryReport(int keyCount, int valueSize) {
+    cout << "keys=" << keyCount << " valueSize=" << valueSize
+         << " sizeof(DataItem)=" << sizeof(DataItem) << " sizeof(CompactEntry)=" << sizeof(CompactEntry) << "\n";
+
+    for(int engine = 0; engine < 2; engine++) {
+        cout.flush();
+        pid_t pid = fork();
+        if(pid == 0) {
+            if(engine == 0) reportMemoryPerKey<KvNode>("KvNode", keyCount, valueSize);
+            else reportMemoryPerKey<CompactKvNode>("CompactKvNode", keyCount, valueSize);
+            cout.flush();
+            _exit(0);
         }
+        waitpid(pid, nullptr, 0);
     }
+}
+
+// log-linear latency buckets, 16 per power of two, so a recorded value is off by at most ~6%
+class LatencyHistogram {
+    static constexpr int subBits = 4;
+    static constexpr uint64_t subCount = 1 << subBits;
+
+    vector<uint64_t> counts = vector<uint64_t>(64 * subCount, 0);
+    uint64_t total = 0;
+    uint64_t maxValue = 0;
+
+    static size_t bucketOf(uint64_t value) {
+        if(value < subCount) return value;
+        int msb = bit_width(value) - 1;
+        return (msb - subBits + 1) * subCount + ((value >> (msb - subBits)) & (subCount - 1));
+    }
+
+    static uint64_t bucketStart(size_t bucket) {
+        if(bucket < subCount) return bucket;
+        int msb = bucket / subCount + subBits - 1;
+        return (subCount + bucket % subCount) << (msb - subBits);
+    }
+
+public:
+    void record(uint64_t value) {
+        counts[bucketOf(value)]++;
+        total++;
+        maxValue = max(maxValue, value);
+    }
+
+    void merge(const LatencyHistogram &other) {
+        for(size_t i = 0; i < counts.size(); i++) counts[i] += other.counts[i];
+        total += other.total;
+        maxValue = max(maxValue, other.maxValue);
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t maxSeen() const { return maxValue; }
+
+    // upper edge of the bucket holding the given fraction of samples
+    uint64_t percentile(double fraction) const {
+        uint64_t target = (uint64_t)ceil(fraction * total);
+        uint64_t seen = 0;
+        for(size_t i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if(seen >= target && counts[i]) return min(maxValue, bucketStart(i + 1) - 1);
+        }
+        return maxValue;
+    }
+};
+
+// key ranks drawn with probability proportional to 1/rank^skew; skew 0 is uniform
+class ZipfSampler {
+    vector<double> cdf;
+
+public:
+    ZipfSampler(size_t n, double skew) {
+        cdf.resize(n);
+        double sum = 0;
+        for(size_t i = 0; i < n; i++) {
+            sum += 1.0 / pow(i + 1, skew);
+            cdf[i] = sum;
+        }
+        for(double &c : cdf) c /= sum;
+    }
+
+    size_t operator()(mt19937_64 &rng) const {
+        double u = uniform_real_distribution<double>(0, 1)(rng);
+        return min(cdf.size() - 1, (size_t)(lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin()));
+    }
+};
+
+struct WorkloadOptions {
+    string engine = "kv";           // kv or compact
+    int threads = 4;
+    int keyCount = 100000;
+    int readPercent = 90;
+    double zipfSkew = 0;
+    // value size -> weight, e.g. 32:90,4096:10
+    vector<pair<int, double>> valueSizes = {{32, 1}};
+    // share of writes that get shortTtl, the rest get longTtl
+    int shortTtlPercent = 0;
+    chrono::seconds shortTtl = chrono::seconds(1);
+    chrono::seconds longTtl = chrono::seconds(3600);
+    chrono::milliseconds duration = chrono::milliseconds(5000);
+    size_t shards = 64;
 };
 
-int main() {
+// false on an unknown or malformed option
+bool parseWorkloadOption(WorkloadOptions &options, const string &arg) {
+    size_t eq = arg.find('=');
+    if(eq == string::npos) return false;
+    string name = arg.substr(0, eq), value = arg.substr(eq + 1);
+
+    try {
+        if(name == "engine" && (value == "kv" || value == "compact")) options.engine = value;
+        else if(name == "threads") options.threads = max(1, stoi(value));
+        else if(name == "keys") options.keyCount = max(1, stoi(value));
+        else if(name == "reads") options.readPercent = clamp(stoi(value), 0, 100);
+        else if(name == "zipf") options.zipfSkew = stod(value);
+        else if(name == "shortTtl") options.shortTtlPercent = clamp(stoi(value), 0, 100);
+        else if(name == "shortTtlSec") options.shortTtl = chrono::seconds(stoi(value));
+        else if(name == "longTtlSec") options.longTtl = chrono::seconds(stoi(value));
+        else if(name == "duration") options.duration = chrono::milliseconds(stoi(value));
+        else if(name == "shards") options.shards = max(1, stoi(value));
+        else if(name == "values") {
+            options.valueSizes.clear();
+            size_t start = 0;
+            while(start < value.size()) {
+                size_t end = value.find(',', start);
+                if(end == string::npos) end = value.size();
+                string part = value.substr(start, end - start);
+                size_t colon = part.find(':');
+                double weight = colon == string::npos ? 1 : stod(part.substr(colon + 1));
+                options.valueSizes.push_back({stoi(part.substr(0, colon)), weight});
+                start = end + 1;
+            }
+            if(options.valueSizes.empty()) return false;
+        }
+        else return false;
+    } catch(const exception&) {
+        return false;
+    }
+    return true;
+}
+
+void printLatency(const char *name, const LatencyHistogram &h) {
+    cout << "  " << name << " n=" << h.count();
+    if(h.count()) {
+        cout << " p50=" << h.percentile(0.5) << "ns p99=" << h.percentile(0.99)
+             << "ns p999=" << h.percentile(0.999) << "ns max=" << h.maxSeen() << "ns";
+    }
+    cout << "\n";
+}
+
+// every key is loaded first, then the worker threads run the mix for options.duration;
+// each operation is timed individually, which adds the cost of two clock reads to it
+template <typename Store>
+void runWorkload(const WorkloadOptions &options) {
+    vector<string> keys;
+    for(int i = 0; i < options.keyCount; i++) keys.push_back("key" + to_string(i));
+    // spread the hot ranks over the key space so they do not all land in one shard
+    vector<size_t> rankToKey(options.keyCount);
+    for(int i = 0; i < options.keyCount; i++) rankToKey[i] = i;
+    shuffle(rankToKey.begin(), rankToKey.end(), mt19937_64(42));
+
+    ZipfSampler sampler(options.keyCount, options.zipfSkew);
+    vector<string> values;
+    vector<double> weights;
+    for(auto &[size, weight] : options.valueSizes) {
+        values.push_back(string(size, 'v'));
+        weights.push_back(weight);
+    }
+
+    Store kvStore(options.shards);
+    for(auto &key : keys) kvStore.put(key, values[0], options.longTtl);
+
+    atomic<bool> stop{false};
+    vector<LatencyHistogram> readLatency(options.threads), writeLatency(options.threads);
+    vector<uint64_t> hits(options.threads, 0);
+    vector<thread> workers;
+
+    for(int t = 0; t < options.threads; t++) {
+        workers.emplace_back([&, t]{
+            mt19937_64 rng(t + 1);
+            discrete_distribution<size_t> valueSize(weights.begin(), weights.end());
+
+            while(!stop.load(memory_order_relaxed)) {
+                const string &key = keys[rankToKey[sampler(rng)]];
+                bool isRead = (int)(rng() % 100) < options.readPercent;
+                const string &value = values[valueSize(rng)];
+                auto ttl = (int)(rng() % 100) < options.shortTtlPercent ? options.shortTtl : options.longTtl;
+
+                auto start = chrono::steady_clock::now();
+                if(isRead) {
+                    if(!kvStore.get(key).empty()) hits[t]++;
+                } else {
+                    kvStore.put(key, value, ttl);
+                }
+                uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+                (isRead ? readLatency[t] : writeLatency[t]).record(ns);
+            }
+        });
+    }
+
+    this_thread::sleep_for(options.duration);
+    stop = true;
+    for(auto &w : workers) w.join();
+
+    LatencyHistogram reads, writes;
+    uint64_t totalHits = 0;
+    for(int t = 0; t < options.threads; t++) {
+        reads.merge(readLatency[t]);
+        writes.merge(writeLatency[t]);
+        totalHits += hits[t];
+    }
+
+    uint64_t ops = reads.count() + writes.count();
+    cout << "ops/sec=" << (uint64_t)(ops * 1000.0 / options.duration.count());
+    if(reads.count()) cout << " hit rate=" << 100.0 * totalHits / reads.count() << "%";
+    cout << "\n";
+    printLatency("reads ", reads);
+    printLatency("writes", writes);
+}
+
+void runLoadGenerator(const WorkloadOptions &options) {
+    cout << "engine=" << options.engine << " threads=" << options.threads << " keys=" << options.keyCount
+         << " reads=" << options.readPercent << "% zipf=" << options.zipfSkew << " values=";
+    for(size_t i = 0; i < options.valueSizes.size(); i++) {
+        cout << (i ? "," : "") << options.valueSizes[i].first << ":" << options.valueSizes[i].second;
+    }
+    cout << " shortTtl=" << options.shortTtlPercent << "%/" << options.shortTtl.count() << "s"
+         << " shards=" << options.shards << " duration=" << options.duration.count() << "ms\n";
+
+    if(options.engine == "compact") runWorkload<CompactKvNode>(options);
+    else runWorkload<KvNode>(options);
+}
+
+int main(int argc, char* argv[]) {
+    string mode = argc > 1 ? argv[1] : "";
+
+    if(mode == "bench") {
+        // ./main bench [shardCount]
+        size_t shardCount = argc > 2 ? stoul(argv[2]) : 64;
+        runScalingBenchmark(shardCount);
+        return 0;
+    }
+
+    if(mode == "bench-wal") {
+        // ./main bench-wal [threads]
+        runWalBenchmark(argc > 2 ? stoi(argv[2]) : 8);
+        return 0;
+    }
+
+    if(mode == "loadgen") {
+        // ./main loadgen [engine=kv|compact] [threads=4] [keys=100000] [reads=90] [zipf=0.99]
+        //     [values=32:90,4096:10] [shortTtl=0] [shortTtlSec=1] [longTtlSec=3600]
+        //     [duration=5000] [shards=64]
+        WorkloadOptions options;
+        for(int i = 2; i < argc; i++) {
+            if(!parseWorkloadOption(options, argv[i])) {
+                cerr << "bad option: " << argv[i] << "\n";
+                return 1;
+            }
+        }
+        runLoadGenerator(options);
+        return 0;
+    }
+
+    if(mode == "memreport") {
+        // ./main memreport [keyCount] [valueSize]
+        int keyCount = argc > 2 ? stoi(argv[2]) : 10000000;
+        int valueSize = argc > 3 ? stoi(argv[3]) : 32;
+        runMemoryReport(keyCount, valueSize);
+        return 0;
+    }
+
     KvNode kvStore;
 
     kvStore.put("key1", "value1", chrono::seconds(5));
@@ -136,5 +2003,20 @@ int main() {
     cout << "Updating key2..." << endl;
     kvStore.put("key2", "value2-updated", chrono::seconds(10));
     cout << "Get updated key2: " << kvStore.get("key2") << endl;
+
+    // handles share the stored buffer instead of copying it
+    ValueHandle handle = kvStore.getHandle("key2");
+    kvStore.put("key2", string("value2-replaced"), chrono::seconds(10));
+    cout << "Handle taken before replace: " << *handle << ", current: " << *kvStore.getHandle("key2") << endl;
+
+    // optimistic update: the second writer holds a stale version and loses
+    VersionedValue seen = kvStore.getWithVersion("key2");
+    int64_t version = kvStore.compareAndSet("key2", seen.version, "value2-cas", chrono::seconds(10));
+    cout << "CAS at version " << seen.version << ": " << (version ? "applied" : "rejected") << endl;
+    version = kvStore.compareAndSet("key2", seen.version, "value2-stale", chrono::seconds(10));
+    cout << "CAS at stale version " << seen.version << ": " << (version ? "applied" : "rejected") << ", current: " << kvStore.get("key2") << endl;
+
+    kvStore.increment("counter", 5, chrono::seconds(10));
+    cout << "Counter: " << *kvStore.increment("counter", 1, chrono::seconds(10)) << endl;
     return 0;
-}
\ No newline at end of file
+}
@@ -1,15 +1,63 @@
 #include<iostream>
 #include<deque>
+#include<queue>
 #include<thread>
+#include<mutex>
 #include<condition_variable>
+#include<atomic>
+#include<chrono>
+#include<string>
+#include<vector>
+#include<memory>
+#include<unordered_map>
+#include<functional>
+#include<span>
+#include<algorithm>
+#include<string_view>
+#include<cstring>
+#include<cstdio>
+#include<filesystem>
+#include<unistd.h>
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<bit>
+#include<cmath>
+#include<coroutine>
+#include<latch>
 
 using namespace std;
 
+// a message body, written once at publish and shared read-only from then on. Small trivially
+// copyable bodies are kept inline; anything else lives in one refcounted allocation, so the
+// queue, the in-flight table and the retry path only ever copy a pointer.
+template <typename T>
+class Payload {
+    static constexpr bool isInline = is_trivially_copyable_v<T> && sizeof(T) <= 32;
+    conditional_t<isInline, T, shared_ptr<const T>> value;
+
+public:
+    Payload() = default;
+
+    explicit Payload(T body) {
+        if constexpr(isInline) value = body;
+        else value = make_shared<const T>(move(body));
+    }
+
+    const T& get() const {
+        if constexpr(isInline) return value;
+        else return *value;
+    }
+
+    const T& operator*() const { return get(); }
+    const T* operator->() const { return &get(); }
+};
+
 template <typename T>
 struct Message {
 public:
-    string id;
-    T payload;
+    uint64_t id;
+    Payload<T> payload;
 
     // timing
     chrono::steady_clock::time_point enqueueTime;
@@ -19,6 +67,8 @@ public:
 
     int retryCount=0;
     int shardId = 0;
+    // the shard lane it was published to, higher is more urgent
+    int priority = 0;
 };
 
 struct RetryItem {
@@ -30,145 +80,2517 @@ struct RetryItem {
     }
 };
 
-template <typename T>
-class Queue_shard {
-    deque<Message<T>> q;
+// futex style wake-up: waiters sleep on an atomic counter, and ring() only bumps it and
+// makes the wake-up syscall when somebody is actually asleep, once per sleep
+class Doorbell {
+    atomic<uint32_t> signal{0};
+    atomic<bool> asleep{false};
+
+    // atomic wait has no timeout, so waiters with a deadline park on a condition variable
+    mutex timedMux;
+    condition_variable timedCv;
+
+    // rung along with this one, for waiters further out
+    Doorbell *next;
+
+    // tries before going to sleep, cheap compared to a futex round trip
+    static constexpr int spinCount = 64;
+
+public:
+    explicit Doorbell(Doorbell *next = nullptr) : next(next) {}
+
+    void ring() {
+        // pairs with the sleeper's store: either we see it, or its retry sees our update
+        atomic_thread_fence(memory_order_seq_cst);
+        if(asleep.load(memory_order_relaxed) && asleep.exchange(false, memory_order_relaxed)) {
+            // everyone that was asleep wakes; those that find nothing go back to sleep
+            signal.fetch_add(1, memory_order_release);
+            signal.notify_all();
+            {
+                lock_guard<mutex> lock(timedMux);
+            }
+            timedCv.notify_all();
+        }
+        if(next) next->ring();
+    }
+
+    // blocks until attempt() returns true; whoever makes it succeed must ring()
+    template <typename Try>
+    void waitUntil(Try &&attempt) {
+        for(int i = 0; i < spinCount; i++) if(attempt()) return;
+
+        while(true) {
+            uint32_t seen = signal.load(memory_order_acquire);
+            asleep.store(true, memory_order_seq_cst);
+            if(attempt()) return;
+            signal.wait(seen, memory_order_acquire);
+        }
+    }
+
+    // same, but gives up at deadline; false if attempt() never succeeded
+    template <typename Try>
+    bool waitUntil(Try &&attempt, chrono::steady_clock::time_point deadline) {
+        for(int i = 0; i < spinCount; i++) if(attempt()) return true;
+
+        while(true) {
+            uint32_t seen = signal.load(memory_order_acquire);
+            asleep.store(true, memory_order_seq_cst);
+            if(attempt()) return true;
+
+            unique_lock<mutex> lock(timedMux);
+            bool rung = timedCv.wait_until(lock, deadline, [&]{return signal.load(memory_order_acquire) != seen;});
+            if(!rung) return attempt();
+        }
+    }
+};
+
+// the original shard storage: one mutex and two condition variables
+template <typename E>
+class DequeBuffer {
+    deque<E> q;
     mutex mux;
     condition_variable notFullCv;
     condition_variable notEmptyCv;
-    int capacity;
-    int shardId;
-    bool shutDownFlag;
+    size_t capacity;
+    // rung after every push, for consumers waiting on more than this buffer
+    Doorbell *onPush;
 
-    atomic<uint64_t> idCounter{0};
+    void pushed(size_t count) {
+        if(count == 1) notEmptyCv.notify_one();
+        else if(count > 1) notEmptyCv.notify_all();
+        if(count && onPush) onPush->ring();
+    }
 
-    unordered_map<uint64_t, Message<T>> inFlightMsg;
-    mutex inFlightMsgMux;
+public:
+    explicit DequeBuffer(size_t cap, Doorbell *onPush = nullptr) : capacity(cap), onPush(onPush) {}
 
-    // used to decide when and how a item is pushed from inFlightMsg back to queue for retry
-    priority_queue<RetryItem, vector<RetryItem>, greater<RetryItem>> retryMinHeap;
-    mutex retryMux;
-    condition_variable retryCv;
+    // blocks while full
+    void push(E value) {
+        {
+            unique_lock<mutex> lock(mux);
+            notFullCv.wait(lock, [&]{return q.size() < capacity;});
+            q.push_back(move(value));
+        }
+        pushed(1);
+    }
 
-    thread retryThread;
+    // false if full; value is only moved from on success
+    bool tryPush(E &value) {
+        {
+            lock_guard<mutex> lock(mux);
+            if(q.size() >= capacity) return false;
+            q.push_back(move(value));
+        }
+        pushed(1);
+        return true;
+    }
 
-public:
-    Queue_shard(int cap, int id) : capacity{cap}, shardId{id}, shutDownFlag{false} {
-        retryThread = thread(&MessageQueue::retryWorker, this);
+    // waits until deadline for room; value is only moved from on success
+    bool pushUntil(E &value, chrono::steady_clock::time_point deadline) {
+        {
+            unique_lock<mutex> lock(mux);
+            if(!notFullCv.wait_until(lock, deadline, [&]{return q.size() < capacity;})) return false;
+            q.push_back(move(value));
+        }
+        pushed(1);
+        return true;
+    }
+
+    size_t size() {
+        lock_guard<mutex> lock(mux);
+        return q.size();
+    }
+
+    // moves in as many of values as fit under one lock; returns how many
+    size_t tryPushBulk(E *values, size_t n) {
+        size_t count;
+        {
+            lock_guard<mutex> lock(mux);
+            count = min(n, capacity - min(capacity, q.size()));
+            for(size_t i = 0; i < count; i++) q.push_back(move(values[i]));
+        }
+        pushed(count);
+        return count;
+    }
+
+    // blocks until all of values are in, taking the lock once per stretch of free space
+    void pushBulk(E *values, size_t n) {
+        size_t done = 0;
+        while(done < n) {
+            size_t count;
+            {
+                unique_lock<mutex> lock(mux);
+                notFullCv.wait(lock, [&]{return q.size() < capacity;});
+                count = min(n - done, capacity - q.size());
+                for(size_t i = 0; i < count; i++) q.push_back(move(values[done + i]));
+            }
+            pushed(count);
+            done += count;
+        }
+    }
+
+    bool tryPop(E &out) {
+        lock_guard<mutex> lock(mux);
+        if(q.empty()) return false;
+        out = move(q.front());
+        q.pop_front();
+        notFullCv.notify_one();
+        return true;
+    }
+
+    // appends up to n to out; returns how many
+    size_t tryPopBulk(vector<E> &out, size_t n) {
+        lock_guard<mutex> lock(mux);
+        size_t count = min(n, q.size());
+        for(size_t i = 0; i < count; i++) {
+            out.push_back(move(q.front()));
+            q.pop_front();
+        }
+        if(count) notFullCv.notify_all();
+        return count;
+    }
+
+    // waits until deadline for at least one; returns how many were appended
+    size_t popBulk(vector<E> &out, size_t n, chrono::steady_clock::time_point deadline) {
+        {
+            unique_lock<mutex> lock(mux);
+            if(!notEmptyCv.wait_until(lock, deadline, [&]{return !q.empty();})) return 0;
+        }
+        return tryPopBulk(out, n);
     }
 
-    void publish(const T &payload, chrono::milliseconds ttl) {
+    // blocks while empty
+    E pop() {
         unique_lock<mutex> lock(mux);
-        notFullCv.wait(lock, [&]{return q.size() < capacity;});
+        notEmptyCv.wait(lock, [&]{return !q.empty();});
+        E value = move(q.front());
+        q.pop_front();
+        notFullCv.notify_one();
+        return value;
+    }
+};
+
+// bounded MPMC ring (Vyukov): every slot carries a sequence number that says whether it is
+// ready for the next producer or the next consumer, so producers only contend on enqueuePos
+// and consumers on dequeuePos. Nothing is locked; a thread sleeps on a futex (atomic wait)
+// only when the ring is full or empty, and the other side pays for one wake-up syscall per
+// sleep, not one per message.
+template <typename E>
+class RingBuffer {
+    struct alignas(64) Slot {
+        atomic<size_t> sequence;
+        E value;
+    };
+
+    size_t mask;
+    unique_ptr<Slot[]> slots;
+
+    alignas(64) atomic<size_t> enqueuePos{0};
+    alignas(64) atomic<size_t> dequeuePos{0};
+
+    // consumers wait on pushed, producers on popped
+    alignas(64) Doorbell pushed;
+    alignas(64) Doorbell popped;
+    // rung after every push, for consumers waiting on more than this ring
+    Doorbell *onPush;
+
+    void wakeConsumers() {
+        pushed.ring();
+        if(onPush) onPush->ring();
+    }
+
+public:
+    // capacity is rounded up to a power of two
+    explicit RingBuffer(size_t capacity, Doorbell *onPush = nullptr) : onPush(onPush) {
+        size_t size = 2;
+        while(size < capacity) size *= 2;
+        mask = size - 1;
+        slots.reset(new Slot[size]);
+        for(size_t i = 0; i < size; i++) slots[i].sequence.store(i, memory_order_relaxed);
+    }
+
+    // false if full; value is only moved from on success
+    bool tryPush(E &value) {
+        size_t pos = enqueuePos.load(memory_order_relaxed);
+        while(true) {
+            Slot &slot = slots[pos & mask];
+            intptr_t diff = (intptr_t)slot.sequence.load(memory_order_acquire) - (intptr_t)pos;
+            if(diff == 0) {
+                if(enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    slot.value = move(value);
+                    slot.sequence.store(pos + 1, memory_order_release);
+                    wakeConsumers();
+                    return true;
+                }
+            } else if(diff < 0) {
+                // the consumer a lap behind has not freed this slot yet
+                return false;
+            } else {
+                pos = enqueuePos.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    // claims a run of free slots with a single CAS and fills it from values; returns how
+    // many were moved in
+    size_t tryPushBulk(E *values, size_t n) {
+        size_t pos = enqueuePos.load(memory_order_relaxed);
+        while(true) {
+            size_t count = 0;
+            while(count < n && slots[(pos + count) & mask].sequence.load(memory_order_acquire) == pos + count) count++;
+
+            if(count == 0) {
+                size_t current = enqueuePos.load(memory_order_relaxed);
+                if(current == pos) return 0;
+                pos = current;
+                continue;
+            }
+
+            if(enqueuePos.compare_exchange_weak(pos, pos + count, memory_order_relaxed)) {
+                for(size_t i = 0; i < count; i++) {
+                    Slot &slot = slots[(pos + i) & mask];
+                    slot.value = move(values[i]);
+                    slot.sequence.store(pos + i + 1, memory_order_release);
+                }
+                wakeConsumers();
+                return count;
+            }
+        }
+    }
+
+    // blocks until all of values are in
+    void pushBulk(E *values, size_t n) {
+        size_t done = 0;
+        while(done < n) {
+            popped.waitUntil([&]{
+                size_t count = tryPushBulk(values + done, n - done);
+                done += count;
+                return count > 0;
+            });
+        }
+    }
+
+    bool tryPop(E &out) {
+        size_t pos = dequeuePos.load(memory_order_relaxed);
+        while(true) {
+            Slot &slot = slots[pos & mask];
+            intptr_t diff = (intptr_t)slot.sequence.load(memory_order_acquire) - (intptr_t)(pos + 1);
+            if(diff == 0) {
+                if(dequeuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    out = move(slot.value);
+                    slot.sequence.store(pos + mask + 1, memory_order_release);
+                    popped.ring();
+                    return true;
+                }
+            } else if(diff < 0) {
+                return false;
+            } else {
+                pos = dequeuePos.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    // claims a run of filled slots with a single CAS and appends them to out; returns how many
+    size_t tryPopBulk(vector<E> &out, size_t n) {
+        size_t pos = dequeuePos.load(memory_order_relaxed);
+        while(true) {
+            size_t count = 0;
+            while(count < n && slots[(pos + count) & mask].sequence.load(memory_order_acquire) == pos + count + 1) count++;
+
+            if(count == 0) {
+                size_t current = dequeuePos.load(memory_order_relaxed);
+                if(current == pos) return 0;
+                pos = current;
+                continue;
+            }
+
+            if(dequeuePos.compare_exchange_weak(pos, pos + count, memory_order_relaxed)) {
+                for(size_t i = 0; i < count; i++) {
+                    Slot &slot = slots[(pos + i) & mask];
+                    out.push_back(move(slot.value));
+                    slot.sequence.store(pos + i + mask + 1, memory_order_release);
+                }
+                popped.ring();
+                return count;
+            }
+        }
+    }
+
+    // waits until deadline for at least one; returns how many were appended
+    size_t popBulk(vector<E> &out, size_t n, chrono::steady_clock::time_point deadline) {
+        size_t count = 0;
+        pushed.waitUntil([&]{ return (count = tryPopBulk(out, n)) > 0; }, deadline);
+        return count;
+    }
+
+    // blocks while full
+    void push(E value) {
+        popped.waitUntil([&]{ return tryPush(value); });
+    }
+
+    // waits until deadline for room; value is only moved from on success
+    bool pushUntil(E &value, chrono::steady_clock::time_point deadline) {
+        return popped.waitUntil([&]{ return tryPush(value); }, deadline);
+    }
+
+    // a snapshot, possibly stale by the time it returns
+    size_t size() {
+        size_t dequeued = dequeuePos.load(memory_order_relaxed);
+        size_t enqueued = enqueuePos.load(memory_order_relaxed);
+        return enqueued > dequeued ? enqueued - dequeued : 0;
+    }
+
+    // blocks while empty
+    E pop() {
+        E value;
+        pushed.waitUntil([&]{ return tryPop(value); });
+        return value;
+    }
+};
+
+// how long a delivery may stay unacked, and what happens to it after that
+struct RedeliveryPolicy {
+    chrono::milliseconds visibilityTimeout = chrono::seconds(30);
+    // wait before a redelivery: initialBackoff, doubled for every earlier retry, capped at maxBackoff
+    chrono::milliseconds initialBackoff = chrono::milliseconds(100);
+    chrono::milliseconds maxBackoff = chrono::seconds(30);
+    // a message that times out after this many redeliveries goes to the dead-letter queue
+    int maxRetries = 5;
+
+    chrono::milliseconds backoffFor(int retryCount) const {
+        int doublings = min(max(retryCount - 1, 0), 30);
+        return min(maxBackoff, initialBackoff * (int64_t(1) << doublings));
+    }
+};
+
+// a point-in-time view of one shard. Counters only ever grow, so rates come from two views
+struct ShardStats {
+    chrono::steady_clock::time_point takenAt;
+    // messages waiting in each lane, out of laneCapacity
+    vector<size_t> depth;
+    size_t laneCapacity = 0;
+    size_t inFlight = 0;
+    size_t scheduled = 0;
+    size_t deadLetters = 0;
+
+    // enqueued includes redeliveries and released scheduled messages, dequeued includes TTL drops
+    uint64_t enqueued = 0;
+    uint64_t dequeued = 0;
+    uint64_t redelivered = 0;
+    uint64_t ttlDrops = 0;
+    uint64_t deadLettered = 0;
+    // publishes that found their lane full, the time they spent waiting, and the
+    // tryPublishFor calls that gave up
+    uint64_t blockedPublishes = 0;
+    chrono::nanoseconds producerBlocked{0};
+    uint64_t publishTimeouts = 0;
+
+    // enqueue to delivery: bucket 0 counts latencies under 1us, bucket i those in [2^(i-1), 2^i) us
+    vector<uint64_t> latencyBuckets;
 
+    double enqueueRate(const ShardStats &earlier) const { return perSecond(enqueued - earlier.enqueued, earlier); }
+    double dequeueRate(const ShardStats &earlier) const { return perSecond(dequeued - earlier.dequeued, earlier); }
+
+    // upper edge, in microseconds, of the bucket holding the given fraction of deliveries
+    uint64_t latencyPercentileUs(double fraction) const {
+        uint64_t total = 0;
+        for(uint64_t count : latencyBuckets) total += count;
+        uint64_t target = max((uint64_t)1, (uint64_t)ceil(fraction * total));
+        uint64_t seen = 0;
+        for(size_t i = 0; i < latencyBuckets.size(); i++) {
+            seen += latencyBuckets[i];
+            if(seen >= target) return uint64_t(1) << i;
+        }
+        return 0;
+    }
+
+private:
+    double perSecond(uint64_t delta, const ShardStats &earlier) const {
+        double seconds = chrono::duration<double>(takenAt - earlier.takenAt).count();
+        return seconds > 0 ? delta / seconds : 0;
+    }
+};
+
+// the live counters behind ShardStats, striped by thread so producers and consumers on
+// different cores rarely write the same cache line; a snapshot adds the stripes up
+class ShardMetrics {
+public:
+    static constexpr size_t latencyBucketCount = 32;
+
+    struct alignas(64) Stripe {
+        atomic<uint64_t> enqueued{0};
+        atomic<uint64_t> dequeued{0};
+        atomic<uint64_t> redelivered{0};
+        atomic<uint64_t> ttlDrops{0};
+        atomic<uint64_t> deadLettered{0};
+        atomic<uint64_t> blockedPublishes{0};
+        atomic<uint64_t> blockedNs{0};
+        atomic<uint64_t> publishTimeouts{0};
+        atomic<uint64_t> latency[latencyBucketCount]{};
+
+        void add(atomic<uint64_t> &counter, uint64_t n) { counter.fetch_add(n, memory_order_relaxed); }
+
+        void recordLatency(chrono::steady_clock::duration latency) {
+            uint64_t us = max((int64_t)0, (int64_t)chrono::duration_cast<chrono::microseconds>(latency).count());
+            add(this->latency[min((size_t)bit_width(us), latencyBucketCount - 1)], 1);
+        }
+    };
+
+    Stripe& local() {
+        static atomic<size_t> threadCount{0};
+        thread_local size_t index = threadCount.fetch_add(1, memory_order_relaxed) % stripeCount;
+        return stripes[index];
+    }
+
+    // fills in the counters of stats, the caller fills in the gauges
+    void collect(ShardStats &stats) {
+        stats.latencyBuckets.assign(latencyBucketCount, 0);
+        uint64_t blockedNs = 0;
+        for(Stripe &stripe : stripes) {
+            stats.enqueued += stripe.enqueued.load(memory_order_relaxed);
+            stats.dequeued += stripe.dequeued.load(memory_order_relaxed);
+            stats.redelivered += stripe.redelivered.load(memory_order_relaxed);
+            stats.ttlDrops += stripe.ttlDrops.load(memory_order_relaxed);
+            stats.deadLettered += stripe.deadLettered.load(memory_order_relaxed);
+            stats.blockedPublishes += stripe.blockedPublishes.load(memory_order_relaxed);
+            blockedNs += stripe.blockedNs.load(memory_order_relaxed);
+            stats.publishTimeouts += stripe.publishTimeouts.load(memory_order_relaxed);
+            for(size_t i = 0; i < latencyBucketCount; i++) stats.latencyBuckets[i] += stripe.latency[i].load(memory_order_relaxed);
+        }
+        stats.producerBlocked = chrono::nanoseconds(blockedNs);
+    }
+
+private:
+    static constexpr size_t stripeCount = 8;
+    Stripe stripes[stripeCount];
+};
+
+// runs resumed coroutines on a fixed set of threads, so any number of suspended consumers
+// and producers costs frames, not threads
+class CoroutinePool {
+    mutex mux;
+    condition_variable cv;
+    deque<coroutine_handle<>> runnable;
+    bool stopping = false;
+    vector<thread> workers;
+
+    void worker() {
+        while(true) {
+            coroutine_handle<> handle;
+            {
+                unique_lock<mutex> lock(mux);
+                cv.wait(lock, [&]{return stopping || !runnable.empty();});
+                if(runnable.empty()) return;
+                handle = runnable.front();
+                runnable.pop_front();
+            }
+            handle.resume();
+        }
+    }
+
+public:
+    explicit CoroutinePool(size_t threads) {
+        for(size_t i = 0; i < max(threads, (size_t)1); i++) workers.emplace_back(&CoroutinePool::worker, this);
+    }
+
+    // runs whatever is still runnable, then stops; coroutines still suspended elsewhere are
+    // not resumed
+    ~CoroutinePool() {
+        {
+            lock_guard<mutex> lock(mux);
+            stopping = true;
+        }
+        cv.notify_all();
+        for(auto &t : workers) t.join();
+    }
+
+    void post(coroutine_handle<> handle) {
+        {
+            lock_guard<mutex> lock(mux);
+            runnable.push_back(handle);
+        }
+        cv.notify_one();
+    }
+
+    // co_await pool.schedule() moves the coroutine onto the pool
+    auto schedule() {
+        struct Awaiter {
+            CoroutinePool &pool;
+            bool await_ready() { return false; }
+            void await_suspend(coroutine_handle<> handle) { pool.post(handle); }
+            void await_resume() {}
+        };
+        return Awaiter{*this};
+    }
+};
+
+// a coroutine nobody waits for: it starts right away and frees itself when it returns
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() { return {}; }
+        suspend_never initial_suspend() noexcept { return {}; }
+        suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+};
+
+// how a shard splits its messages into lanes; lane 0 is the default and the least urgent
+struct PriorityPolicy {
+    size_t lanes = 1;
+    // empty means strict priority: a lane is only served while every more urgent one is empty.
+    // Otherwise lane i gets weights[i] out of every sum(weights) pops, as long as it has
+    // messages; an empty lane's turn goes to the others
+    vector<uint32_t> weights;
+};
+
+template <typename T, typename Buffer = RingBuffer<Message<T>>>
+class Queue_shard {
+    // rung by every lane when there is more than one, so a consumer can sleep on all of them
+    Doorbell laneReady;
+    // one buffer per priority, each with the full capacity, so a backlog in one lane never
+    // blocks publishes to another
+    vector<unique_ptr<Buffer>> lanes;
+    // weighted mode: the lane each pop looks at first, in smooth weighted round-robin order
+    vector<uint8_t> schedule;
+    atomic<uint32_t> scheduleCursor{0};
+    int shardId;
+    RedeliveryPolicy policy;
+    // weighted mode only
+    vector<uint32_t> laneWeights;
+    size_t laneCapacity;
+    ShardMetrics metrics;
+
+    atomic<uint64_t> idCounter{0};
+
+    // a delivered message, linked into its stripe's deadline list until acked or timed out
+    struct InFlightEntry {
+        Message<T> msg;
+        chrono::steady_clock::time_point deadline;
+        InFlightEntry *prev = nullptr;
+        InFlightEntry *next = nullptr;
+    };
+
+    // in-flight messages are striped by id so consumers seldom share a lock. Each stripe
+    // threads an intrusive list through its entries in deadline order; every delivery gets
+    // the same visibility timeout, so appending keeps it sorted. ack unlinks in O(1) and the
+    // retry worker only ever looks at entries that are due.
+    struct alignas(64) InFlightStripe {
+        mutex mux;
+        // node based, so entries do not move when the table grows
+        unordered_map<uint64_t, InFlightEntry> entries;
+        InFlightEntry *oldest = nullptr;
+        InFlightEntry *newest = nullptr;
+
+        void track(const Message<T> &msg, chrono::steady_clock::time_point deadline) {
+            InFlightEntry &entry = entries[msg.id];
+            entry.msg = msg;
+            entry.deadline = deadline;
+            entry.prev = newest;
+            entry.next = nullptr;
+            if(newest) newest->next = &entry;
+            else oldest = &entry;
+            newest = &entry;
+        }
+
+        // unlinks and erases; the message is moved to out if given
+        bool untrack(uint64_t id, Message<T> *out = nullptr) {
+            auto it = entries.find(id);
+            if(it == entries.end()) return false;
+
+            InFlightEntry &entry = it->second;
+            if(entry.prev) entry.prev->next = entry.next;
+            else oldest = entry.next;
+            if(entry.next) entry.next->prev = entry.prev;
+            else newest = entry.prev;
+
+            if(out) *out = move(entry.msg);
+            entries.erase(it);
+            return true;
+        }
+    };
+    static constexpr size_t stripeCount = 16;
+    InFlightStripe inFlight[stripeCount];
+
+    InFlightStripe& stripeFor(uint64_t id) { return inFlight[id % stripeCount]; }
+
+    Message<T> makeMessage(Payload<T> payload, chrono::milliseconds ttl, int priority) {
         Message<T> msg;
-        msg.id = idCounter.fetch_add(1);
-        msg.payload = payload;
+        msg.id = idCounter.fetch_add(1, memory_order_relaxed);
+        msg.payload = move(payload);
 
         msg.enqueueTime = chrono::steady_clock::now();
         msg.ttl = ttl;
         msg.expiryTime = msg.enqueueTime + ttl;
 
         msg.shardId = shardId;
+        msg.priority = clamp(priority, 0, (int)lanes.size() - 1);
+        return msg;
+    }
 
-        q.push_back(move(msg));
-        notEmptyCv.notify_one();
+    vector<Message<T>> makeMessages(span<const T> payloads, chrono::milliseconds ttl, int priority) {
+        vector<Message<T>> batch(payloads.size());
+        uint64_t firstId = idCounter.fetch_add(payloads.size(), memory_order_relaxed);
+        auto now = chrono::steady_clock::now();
+
+        for(size_t i = 0; i < payloads.size(); i++) {
+            Message<T> &msg = batch[i];
+            msg.id = firstId + i;
+            msg.payload = Payload<T>(payloads[i]);
+            msg.enqueueTime = now;
+            msg.ttl = ttl;
+            msg.expiryTime = now + ttl;
+            msg.shardId = shardId;
+            msg.priority = clamp(priority, 0, (int)lanes.size() - 1);
+        }
+        return batch;
     }
 
-    Message<T> consume() {
-        unique_lock<mutex> lock(mux);
+    Buffer& laneOf(const Message<T> &msg) { return *lanes[msg.priority]; }
 
-        while(true) {
-            notEmptyCv.wait(lock, [&]{return !q.empty();});
+    // the lane the schedule picks in weighted mode, the most urgent one otherwise
+    size_t firstLane() {
+        if(schedule.empty()) return lanes.size() - 1;
+        return schedule[scheduleCursor.fetch_add(1, memory_order_relaxed) % schedule.size()];
+    }
 
-            Message<T> msg = q.front();
-            q.pop_front();
-            notFullCv.notify_one();
+    bool tryPopNext(Message<T> &out) {
+        size_t first = firstLane();
+        if(lanes[first]->tryPop(out)) return true;
+        for(size_t i = lanes.size(); i-- > 0;) {
+            if(i != first && lanes[i]->tryPop(out)) return true;
+        }
+        return false;
+    }
 
-            // if message is expired, check for next message
-            if(msg.expiryTime <= chrono::steady_clock::now()) continue;
-            
-            // Put the message into in-flight ALWAYS
-            {
-                lock_guard<mutex> lk(inFlightMsgMux);
-                msg.deliveryTime = chrono::time_point::now();
-                inFlightMsg[msg.id] = msg;
+    // weighted mode first gives every lane its share of n, then, like strict mode, fills up
+    // from the most urgent lane down
+    size_t tryPopBulkNext(vector<Message<T>> &out, size_t n) {
+        size_t start = out.size();
+        if(!schedule.empty()) {
+            uint64_t total = 0;
+            for(uint32_t w : laneWeights) total += w;
+            for(size_t i = lanes.size(); i-- > 0;) {
+                size_t share = (n * laneWeights[i] + total - 1) / total;
+                lanes[i]->tryPopBulk(out, min(share, n - (out.size() - start)));
             }
-            
-            
-            return msg;
         }
+        for(size_t i = lanes.size(); i-- > 0 && out.size() - start < n;) {
+            lanes[i]->tryPopBulk(out, n - (out.size() - start));
+        }
+        return out.size() - start;
     }
 
-    void ack(int id) {
-        unique_lock<mutex> lock(inFlightMsgMux);
-        if(inFlightMsg.find(id) != inFlightMsg.end())
-            inFlightMsg.erase(id);
+    // drops the expired messages in batch[from..] and puts the rest in flight, taking each
+    // stripe's lock at most once
+    void deliverBatch(vector<Message<T>> &batch, size_t from) {
+        auto now = chrono::steady_clock::now();
+        size_t popped = batch.size() - from;
+        auto live = remove_if(batch.begin() + from, batch.end(), [&](const Message<T> &msg) {
+            return msg.expiryTime <= now;
+        });
+        batch.erase(live, batch.end());
+
+        ShardMetrics::Stripe &counters = metrics.local();
+        counters.add(counters.dequeued, popped);
+        if(popped != batch.size() - from) counters.add(counters.ttlDrops, popped - (batch.size() - from));
+
+        uint32_t touched = 0;
+        for(size_t i = from; i < batch.size(); i++) {
+            batch[i].deliveryTime = now;
+            counters.recordLatency(now - batch[i].enqueueTime);
+            touched |= 1u << (batch[i].id % stripeCount);
+        }
+
+        for(size_t s = 0; s < stripeCount; s++) {
+            if(!(touched & (1u << s))) continue;
+            InFlightStripe &stripe = inFlight[s];
+            lock_guard<mutex> lock(stripe.mux);
+            for(size_t i = from; i < batch.size(); i++) {
+                if(batch[i].id % stripeCount == s) stripe.track(batch[i], now + policy.visibilityTimeout);
+            }
+        }
     }
 
-    void retryWorker() {
-        while(!shutDownFlag) {
-            vector<Message<T>> expired;
+    // false if the message expired while queued; otherwise it is in flight until acked
+    bool deliver(Message<T> &msg) {
+        auto now = chrono::steady_clock::now();
+        ShardMetrics::Stripe &counters = metrics.local();
+        counters.add(counters.dequeued, 1);
+        if(msg.expiryTime <= now) {
+            counters.add(counters.ttlDrops, 1);
+            return false;
+        }
+        counters.recordLatency(now - msg.enqueueTime);
 
-            // step 1: scan inFlight items
-            {
-                unique_lock<mutex> lock(inFlightMsgMux);
-                auto now = chrono::time_point::now();
+        // Put the message into in-flight ALWAYS
+        InFlightStripe &stripe = stripeFor(msg.id);
+        lock_guard<mutex> lk(stripe.mux);
+        msg.deliveryTime = now;
+        stripe.track(msg, now + policy.visibilityTimeout);
+        return true;
+    }
 
-                for(auto &[id, msg] : inFlightMsg) {
-                    // message is not acked within 100 seconds of delivery:: Retry
-                    if(msg.deliveryTime < now - 100*chrono::milliseconds) {
-                        expired.push_back(msg);
-                    }
-                }
+    // removes the next message that has not expired and puts it in flight
+    bool tryTake(Message<T> &out) {
+        while(tryPopNext(out)) {
+            if(deliver(out)) return true;
+        }
+        return false;
+    }
 
-                for(auto &m: expired) inFlightMsg.erase(m.id);
-            }
+    // a suspended co_consume or co_publish, linked into its list from the coroutine frame
+    struct CoWaiter {
+        coroutine_handle<> handle;
+        CoroutinePool *pool = nullptr;
+        Message<T> msg;
+        CoWaiter *next = nullptr;
+    };
 
-            // Step 2: schedule expired messages into retryMinHeap
-            {
-                unique_lock<mutex> lock(retryMux);
-                auto now = chrono::steady_clock::now();
-
-                for(auto &m : expired) {
-                    retryMinHeap.push(
-                        RetryItem{
-                            m.id,
-                            now + 100*chrono::milliseconds;
-                        }
-                    )
-                }
+    struct CoWaiterList {
+        mutex mux;
+        CoWaiter *head = nullptr;
+        CoWaiter *tail = nullptr;
+        // read without the lock by every publish or consume, to skip the lock when empty
+        atomic<size_t> count{0};
 
-                retryCv.notify_one();
-            }
+        void pushBack(CoWaiter *waiter) {
+            waiter->next = nullptr;
+            if(tail) tail->next = waiter;
+            else head = waiter;
+            tail = waiter;
+        }
+
+        void popFront() {
+            head = head->next;
+            if(!head) tail = nullptr;
+            count.fetch_sub(1, memory_order_relaxed);
+        }
+    };
+    CoWaiterList coConsumers;
+    CoWaiterList coPublishers;
+
+    // a waiter bumps count before its last try, and we check count only after our push or
+    // pop, so one of the two always sees the other
+    void afterPush() {
+        atomic_thread_fence(memory_order_seq_cst);
+        if(coConsumers.count.load(memory_order_relaxed)) wakeCoConsumers();
+    }
 
+    void afterPop() {
+        atomic_thread_fence(memory_order_seq_cst);
+        if(coPublishers.count.load(memory_order_relaxed)) wakeCoPublishers();
+    }
 
+    // hands messages to waiting consumers, oldest waiter first, and resumes them on their pool
+    void wakeCoConsumers() {
+        bool isTaken = false;
+        {
+            lock_guard<mutex> lock(coConsumers.mux);
+            while(coConsumers.head && tryTake(coConsumers.head->msg)) {
+                CoWaiter *waiter = coConsumers.head;
+                coConsumers.popFront();
+                waiter->pool->post(waiter->handle);
+                isTaken = true;
+            }
+        }
+        // outside the lock: waking publishers may push and come back here
+        if(isTaken) afterPop();
+    }
 
-            unique_lock<mutex> lock(retryMux);
+    void wakeCoPublishers() {
+        size_t pushed = 0;
+        {
+            lock_guard<mutex> lock(coPublishers.mux);
+            while(coPublishers.head && laneOf(coPublishers.head->msg).tryPush(coPublishers.head->msg)) {
+                CoWaiter *waiter = coPublishers.head;
+                coPublishers.popFront();
+                waiter->pool->post(waiter->handle);
+                pushed++;
+            }
+        }
+        if(pushed) {
+            ShardMetrics::Stripe &counters = metrics.local();
+            counters.add(counters.enqueued, pushed);
+            afterPush();
+        }
+    }
 
-            retryCv.wait(lock, [&]{return !retryMinHeap.empty();});
+    // messages that ran out of retries, until drained
+    mutex deadLetterMux;
+    deque<Message<T>> deadLetters;
 
-            auto retryItem = retryMinHeap.top();
-            
-            // wait until retry time comes
-            retryCv.wait_until(retryItem.retryAt);
+    // a message published for later, released into its lane by the retry worker
+    struct ScheduledItem {
+        chrono::steady_clock::time_point deliverAt;
+        Message<T> msg;
 
-            retryItem = retryMinHeap.top();
-            retryMinHeap.pop();
-            lock.unlock();
+        bool operator>(const ScheduledItem &other) const {
+            if(deliverAt != other.deliverAt) return deliverAt > other.deliverAt;
+            return msg.id > other.msg.id;
+        }
+    };
 
-            // move the retry item back to queue from inFlightMsg
-            {
-                unique_lock<mutex> lock(inFlightMsgMux);
+    // guards shutDownFlag and the scheduled heap; the retry worker sleeps on workerCv until
+    // its next tick or the earliest scheduled delivery, whichever comes first
+    bool shutDownFlag;
+    mutex workerMux;
+    condition_variable workerCv;
+    priority_queue<ScheduledItem, vector<ScheduledItem>, greater<ScheduledItem>> scheduled;
+    thread retryThread;
 
-                if(inFlightMsg.find(retryItem.messageId) == inFlightMsg.end()) continue;
+public:
+    // a consumed message that is not acked within the visibility timeout is delivered again
+    // after a backoff, or dead-lettered once it is out of retries
+    // onReady is rung whenever a message becomes available, for consumers waiting across shards
+    Queue_shard(int cap, int id, RedeliveryPolicy policy = {}, Doorbell *onReady = nullptr, PriorityPolicy priorities = {}) :
+        laneReady(onReady),
+        shardId{id},
+        policy(policy),
+        laneCapacity(cap),
+        shutDownFlag{false} {
+        size_t laneCount = clamp(priorities.lanes, (size_t)1, (size_t)256);
+        // with one lane, consumers block on the buffer itself
+        Doorbell *onPush = laneCount == 1 ? onReady : &laneReady;
+        for(size_t i = 0; i < laneCount; i++) lanes.push_back(make_unique<Buffer>(cap, onPush));
 
-                Message<T> msg = inFlightMsg[retryItem.messageId];
-                inFlightMsg.erase(retryItem.messageId);
-                msg.retryCount--;
+        if(priorities.weights.size() == laneCount) {
+            // smooth weighted round-robin: spreads each lane's turns out instead of in runs
+            vector<int64_t> current(laneCount, 0);
+            int64_t total = 0;
+            for(uint32_t w : priorities.weights) total += w;
+            for(int64_t turn = 0; turn < total; turn++) {
+                size_t best = 0;
+                for(size_t i = 0; i < laneCount; i++) {
+                    current[i] += priorities.weights[i];
+                    if(current[i] > current[best]) best = i;
+                }
+                current[best] -= total;
+                schedule.push_back((uint8_t)best);
             }
+        }
+        if(!schedule.empty()) laneWeights = priorities.weights;
+        retryThread = thread(&Queue_shard::retryWorker, this);
+    }
 
-            publish(msg.payload, ttl);
+    ~Queue_shard() {
+        {
+            lock_guard<mutex> lock(workerMux);
+            shutDownFlag = true;
         }
+        workerCv.notify_all();
+        retryThread.join();
     }
-};
+
+    size_t laneCount() const { return lanes.size(); }
+
+    // the payload is copied once, or moved, and never again. priority picks the lane and is
+    // clamped to the ones there are
+    void publish(T payload, chrono::milliseconds ttl, int priority = 0) {
+        publish(Payload<T>(move(payload)), ttl, priority);
+    }
+
+    // a full lane blocks, and the wait shows up in stats() as producer blocked time
+    void publish(Payload<T> payload, chrono::milliseconds ttl, int priority = 0) {
+        Message<T> msg = makeMessage(move(payload), ttl, priority);
+        ShardMetrics::Stripe &counters = metrics.local();
+        if(!laneOf(msg).tryPush(msg)) {
+            auto start = chrono::steady_clock::now();
+            laneOf(msg).push(move(msg));
+            counters.add(counters.blockedPublishes, 1);
+            counters.add(counters.blockedNs, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+        }
+        counters.add(counters.enqueued, 1);
+        afterPush();
+    }
+
+    // false if the lane is full
+    bool tryPublish(T payload, chrono::milliseconds ttl, int priority = 0) {
+        return tryPublish(Payload<T>(move(payload)), ttl, priority);
+    }
+
+    bool tryPublish(Payload<T> payload, chrono::milliseconds ttl, int priority = 0) {
+        Message<T> msg = makeMessage(move(payload), ttl, priority);
+        if(!laneOf(msg).tryPush(msg)) return false;
+        ShardMetrics::Stripe &counters = metrics.local();
+        counters.add(counters.enqueued, 1);
+        afterPush();
+        return true;
+    }
+
+    // waits at most timeout for room in the lane, so a producer can shed load instead of
+    // hanging on a saturated shard; false if it gave up
+    bool tryPublishFor(T payload, chrono::milliseconds ttl, chrono::milliseconds timeout, int priority = 0) {
+        return tryPublishFor(Payload<T>(move(payload)), ttl, timeout, priority);
+    }
+
+    bool tryPublishFor(Payload<T> payload, chrono::milliseconds ttl, chrono::milliseconds timeout, int priority = 0) {
+        Message<T> msg = makeMessage(move(payload), ttl, priority);
+        ShardMetrics::Stripe &counters = metrics.local();
+        if(laneOf(msg).tryPush(msg)) {
+            counters.add(counters.enqueued, 1);
+            afterPush();
+            return true;
+        }
+
+        auto start = chrono::steady_clock::now();
+        bool isPushed = laneOf(msg).pushUntil(msg, start + timeout);
+        counters.add(counters.blockedPublishes, 1);
+        counters.add(counters.blockedNs, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+        counters.add(isPushed ? counters.enqueued : counters.publishTimeouts, 1);
+        if(isPushed) afterPush();
+        return isPushed;
+    }
+
+    // handed out no earlier than delay from now; ttl counts from then. Never blocks, a
+    // message due while its lane is full waits until there is room
+    void publishAfter(T payload, chrono::milliseconds delay, chrono::milliseconds ttl, int priority = 0) {
+        Message<T> msg = makeMessage(Payload<T>(move(payload)), ttl, priority);
+        auto deliverAt = msg.enqueueTime + delay;
+        msg.expiryTime = deliverAt + ttl;
+
+        bool isEarliest;
+        {
+            lock_guard<mutex> lock(workerMux);
+            isEarliest = scheduled.empty() || deliverAt < scheduled.top().deliverAt;
+            scheduled.push(ScheduledItem{deliverAt, move(msg)});
+        }
+        if(isEarliest) workerCv.notify_one();
+    }
+
+    Message<T> consume() {
+        while(true) {
+            Message<T> msg;
+            if(lanes.size() == 1) msg = lanes[0]->pop();
+            else laneReady.waitUntil([&]{return tryPopNext(msg);});
+            afterPop();
+            if(deliver(msg)) return msg;
+        }
+    }
+
+    // false if the shard is empty
+    bool tryConsume(Message<T> &out) {
+        bool isTaken = tryTake(out);
+        afterPop();
+        return isTaken;
+    }
+
+    // co_await shard.co_consume(pool) gives the next message like consume(), but an empty
+    // shard suspends the coroutine instead of blocking its thread; it is resumed on pool
+    // once a message has been handed to it. The shard must outlive its suspended waiters
+    auto co_consume(CoroutinePool &pool) {
+        struct Awaiter {
+            Queue_shard &shard;
+            CoWaiter waiter;
+
+            bool await_ready() {
+                bool isTaken = shard.tryTake(waiter.msg);
+                shard.afterPop();
+                return isTaken;
+            }
+
+            bool await_suspend(coroutine_handle<> handle) {
+                waiter.handle = handle;
+                CoWaiterList &list = shard.coConsumers;
+                {
+                    lock_guard<mutex> lock(list.mux);
+                    list.count.fetch_add(1, memory_order_seq_cst);
+                    if(!shard.tryTake(waiter.msg)) {
+                        list.pushBack(&waiter);
+                        return true;
+                    }
+                    list.count.fetch_sub(1, memory_order_relaxed);
+                }
+                shard.afterPop();
+                return false;
+            }
+
+            Message<T> await_resume() { return move(waiter.msg); }
+        };
+        Awaiter awaiter{*this, {}};
+        awaiter.waiter.pool = &pool;
+        return awaiter;
+    }
+
+    // co_await shard.co_publish(pool, payload, ttl) publishes like publish(), but a full
+    // lane suspends the coroutine until a consumer makes room and the message is in
+    auto co_publish(CoroutinePool &pool, T payload, chrono::milliseconds ttl, int priority = 0) {
+        struct Awaiter {
+            Queue_shard &shard;
+            CoWaiter waiter;
+
+            bool tryPush() {
+                if(!shard.laneOf(waiter.msg).tryPush(waiter.msg)) return false;
+                ShardMetrics::Stripe &counters = shard.metrics.local();
+                counters.add(counters.enqueued, 1);
+                return true;
+            }
+
+            bool await_ready() {
+                if(!tryPush()) return false;
+                shard.afterPush();
+                return true;
+            }
+
+            bool await_suspend(coroutine_handle<> handle) {
+                waiter.handle = handle;
+                CoWaiterList &list = shard.coPublishers;
+                {
+                    lock_guard<mutex> lock(list.mux);
+                    list.count.fetch_add(1, memory_order_seq_cst);
+                    if(!tryPush()) {
+                        list.pushBack(&waiter);
+                        return true;
+                    }
+                    list.count.fetch_sub(1, memory_order_relaxed);
+                }
+                shard.afterPush();
+                return false;
+            }
+
+            void await_resume() {}
+        };
+        Awaiter awaiter{*this, {}};
+        awaiter.waiter.pool = &pool;
+        awaiter.waiter.msg = makeMessage(Payload<T>(move(payload)), ttl, priority);
+        return awaiter;
+    }
+
+    // the whole batch gets one id range and goes in with as few bulk pushes as free space
+    // allows, each waking consumers once; blocks while the lane is full
+    void publishBatch(span<const T> payloads, chrono::milliseconds ttl, int priority = 0) {
+        if(payloads.empty()) return;
+        vector<Message<T>> batch = makeMessages(payloads, ttl, priority);
+        Buffer &lane = laneOf(batch[0]);
+        ShardMetrics::Stripe &counters = metrics.local();
+        size_t done = lane.tryPushBulk(batch.data(), batch.size());
+        if(done < batch.size()) {
+            auto start = chrono::steady_clock::now();
+            lane.pushBulk(batch.data() + done, batch.size() - done);
+            counters.add(counters.blockedPublishes, 1);
+            counters.add(counters.blockedNs, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+        }
+        counters.add(counters.enqueued, batch.size());
+        afterPush();
+    }
+
+    // up to maxN messages, waiting at most timeout for the first one; empty on timeout
+    vector<Message<T>> consumeBatch(size_t maxN, chrono::milliseconds timeout) {
+        vector<Message<T>> batch;
+        batch.reserve(maxN);
+        auto deadline = chrono::steady_clock::now() + timeout;
+        while(batch.empty()) {
+            bool isReady;
+            if(lanes.size() == 1) isReady = lanes[0]->popBulk(batch, maxN, deadline) > 0;
+            else isReady = laneReady.waitUntil([&]{return tryPopBulkNext(batch, maxN) > 0;}, deadline);
+            if(!isReady) break;
+            afterPop();
+            deliverBatch(batch, 0);
+        }
+        return batch;
+    }
+
+    // appends up to maxN to out without waiting; returns how many
+    size_t tryConsumeBatch(vector<Message<T>> &out, size_t maxN) {
+        size_t start = out.size();
+        bool isPopped = false;
+        while(out.size() - start < maxN) {
+            size_t from = out.size();
+            if(!tryPopBulkNext(out, maxN - (out.size() - start))) break;
+            isPopped = true;
+            deliverBatch(out, from);
+        }
+        if(isPopped) afterPop();
+        return out.size() - start;
+    }
+
+    // takes each in-flight stripe's lock once for the whole batch
+    void ackBatch(const vector<uint64_t> &ids) {
+        uint32_t touched = 0;
+        for(uint64_t id : ids) touched |= 1u << (id % stripeCount);
+
+        for(size_t s = 0; s < stripeCount; s++) {
+            if(!(touched & (1u << s))) continue;
+            lock_guard<mutex> lock(inFlight[s].mux);
+            for(uint64_t id : ids) {
+                if(id % stripeCount == s) inFlight[s].untrack(id);
+            }
+        }
+    }
+
+    // O(1); a no-op, returning false, once the message has timed out
+    bool ack(uint64_t id) {
+        InFlightStripe &stripe = stripeFor(id);
+        lock_guard<mutex> lock(stripe.mux);
+        return stripe.untrack(id);
+    }
+
+    // removes and returns up to maxN dead letters, oldest first
+    vector<Message<T>> drainDeadLetters(size_t maxN) {
+        lock_guard<mutex> lock(deadLetterMux);
+        size_t count = min(maxN, deadLetters.size());
+        vector<Message<T>> drained(make_move_iterator(deadLetters.begin()), make_move_iterator(deadLetters.begin() + count));
+        deadLetters.erase(deadLetters.begin(), deadLetters.begin() + count);
+        return drained;
+    }
+
+    size_t deadLetterCount() {
+        lock_guard<mutex> lock(deadLetterMux);
+        return deadLetters.size();
+    }
+
+    // cheap enough to poll: the counters are summed without locks, only the gauges take
+    // each lock briefly
+    ShardStats stats() {
+        ShardStats stats;
+        stats.takenAt = chrono::steady_clock::now();
+        metrics.collect(stats);
+        for(auto &lane : lanes) stats.depth.push_back(lane->size());
+        stats.laneCapacity = laneCapacity;
+        for(InFlightStripe &stripe : inFlight) {
+            lock_guard<mutex> lock(stripe.mux);
+            stats.inFlight += stripe.entries.size();
+        }
+        {
+            lock_guard<mutex> lock(workerMux);
+            stats.scheduled = scheduled.size();
+        }
+        stats.deadLetters = deadLetterCount();
+        return stats;
+    }
+
+    // each pass costs O(messages due), not O(messages in flight)
+    void retryWorker() {
+        // timed out messages waiting out their backoff; only this thread touches them
+        priority_queue<RetryItem, vector<RetryItem>, greater<RetryItem>> retryMinHeap;
+        unordered_map<uint64_t, Message<T>> backingOff;
+        // redeliveries and scheduled messages that did not fit because their lane was full,
+        // retried on the next pass
+        vector<Message<T>> pending;
+        vector<Message<T>> timedOut;
+
+        auto tick = clamp(min(policy.visibilityTimeout, policy.initialBackoff) / 4, chrono::milliseconds(1), chrono::milliseconds(100));
+        auto nextTick = chrono::steady_clock::now() + tick;
+
+        while(true) {
+            auto now = chrono::steady_clock::now();
+            {
+                unique_lock<mutex> lock(workerMux);
+                while(!shutDownFlag) {
+                    auto wakeAt = nextTick;
+                    if(!scheduled.empty()) wakeAt = min(wakeAt, scheduled.top().deliverAt);
+                    if(now >= wakeAt) break;
+                    workerCv.wait_until(lock, wakeAt);
+                    now = chrono::steady_clock::now();
+                }
+                if(shutDownFlag) return;
+
+                // step 0: scheduled messages that are due join the redeliveries below
+                while(!scheduled.empty() && scheduled.top().deliverAt <= now) {
+                    pending.push_back(scheduled.top().msg);
+                    scheduled.pop();
+                }
+            }
+            if(now >= nextTick) nextTick = now + tick;
+
+            // step 1: take the deliveries whose visibility ran out, oldest first
+            for(InFlightStripe &stripe : inFlight) {
+                lock_guard<mutex> lock(stripe.mux);
+                while(stripe.oldest && stripe.oldest->deadline <= now) {
+                    timedOut.emplace_back();
+                    stripe.untrack(stripe.oldest->msg.id, &timedOut.back());
+                }
+            }
+
+            // step 2: back them off, or dead-letter the ones out of retries
+            ShardMetrics::Stripe &counters = metrics.local();
+            for(auto &msg : timedOut) {
+                if(msg.retryCount >= policy.maxRetries) {
+                    counters.add(counters.deadLettered, 1);
+                    lock_guard<mutex> lock(deadLetterMux);
+                    deadLetters.push_back(move(msg));
+                    continue;
+                }
+                counters.add(counters.redelivered, 1);
+                msg.retryCount++;
+                retryMinHeap.push(RetryItem{msg.id, now + policy.backoffFor(msg.retryCount)});
+                backingOff[msg.id] = move(msg);
+            }
+            timedOut.clear();
+
+            // step 3: backoffs that are over go back to the queue
+            while(!retryMinHeap.empty() && retryMinHeap.top().retryAt <= now) {
+                auto it = backingOff.find(retryMinHeap.top().messageId);
+                retryMinHeap.pop();
+                pending.push_back(move(it->second));
+                backingOff.erase(it);
+            }
+
+            // never block here, a full lane with no consumers would hang shutdown
+            size_t kept = 0;
+            for(auto &msg : pending) {
+                if(!laneOf(msg).tryPush(msg)) pending[kept++] = move(msg);
+            }
+            counters.add(counters.enqueued, pending.size() - kept);
+            if(kept != pending.size()) afterPush();
+            pending.resize(kept);
+        }
+    }
+};
+
+// routes messages over a fixed set of shards. Messages published with the same key land in
+// the same shard, so they are handed out in publish order; keyless ones are spread
+// round-robin. A consumer prefers its home shard and steals from the others when that one
+// is empty, so no shard backs up while a consumer sits idle.
+template <typename T>
+class MessageQueue {
+    vector<unique_ptr<Queue_shard<T>>> shards;
+    // rung by every shard, consumers sleep on it when all shards are empty
+    Doorbell ready;
+
+    // per thread, so routing never touches a shared counter
+    size_t nextShard() {
+        static atomic<size_t> threadCount{0};
+        thread_local size_t next = threadCount.fetch_add(1, memory_order_relaxed);
+        return next++ % shards.size();
+    }
+
+    size_t homeShard() {
+        static atomic<size_t> consumerCount{0};
+        thread_local size_t home = consumerCount.fetch_add(1, memory_order_relaxed);
+        return home % shards.size();
+    }
+
+    // home shard first, then the rest in order after it
+    bool tryConsumeAny(size_t home, Message<T> &out) {
+        for(size_t i = 0; i < shards.size(); i++) {
+            if(shards[(home + i) % shards.size()]->tryConsume(out)) return true;
+        }
+        return false;
+    }
+
+public:
+    // every shard gets the same lanes; priority is honoured within a shard, a consumer still
+    // drains its home shard before stealing
+    MessageQueue(size_t shardCount, int shardCapacity, RedeliveryPolicy policy = {}, PriorityPolicy priorities = {}) {
+        if(shardCount == 0) shardCount = 1;
+        for(size_t i = 0; i < shardCount; i++) {
+            shards.push_back(make_unique<Queue_shard<T>>(shardCapacity, (int)i, policy, &ready, priorities));
+        }
+    }
+
+    size_t shardCount() const { return shards.size(); }
+
+    // round-robin; moves on to the next shard if one is full and only blocks if all are.
+    // The payload is stored once, every shard tried shares it
+    void publish(T payload, chrono::milliseconds ttl, int priority = 0) {
+        Payload<T> body(move(payload));
+        size_t first = nextShard();
+        for(size_t i = 0; i < shards.size(); i++) {
+            if(shards[(first + i) % shards.size()]->tryPublish(body, ttl, priority)) return;
+        }
+        shards[first]->publish(move(body), ttl, priority);
+    }
+
+    // same key, same shard; blocks while that shard's lane is full. Only messages with the
+    // same key and priority keep their order
+    void publish(const string &key, T payload, chrono::milliseconds ttl, int priority = 0) {
+        shards[hash<string>{}(key) % shards.size()]->publish(move(payload), ttl, priority);
+    }
+
+    // gives every shard a go without waiting, then waits at most timeout on the first one
+    bool tryPublishFor(T payload, chrono::milliseconds ttl, chrono::milliseconds timeout, int priority = 0) {
+        Payload<T> body(move(payload));
+        size_t first = nextShard();
+        for(size_t i = 0; i < shards.size(); i++) {
+            if(shards[(first + i) % shards.size()]->tryPublish(body, ttl, priority)) return true;
+        }
+        return shards[first]->tryPublishFor(move(body), ttl, timeout, priority);
+    }
+
+    // handed out no earlier than delay from now, see Queue_shard::publishAfter
+    void publishAfter(T payload, chrono::milliseconds delay, chrono::milliseconds ttl, int priority = 0) {
+        shards[nextShard()]->publishAfter(move(payload), delay, ttl, priority);
+    }
+
+    Message<T> consume() {
+        size_t home = homeShard();
+        Message<T> msg;
+        ready.waitUntil([&]{ return tryConsumeAny(home, msg); });
+        return msg;
+    }
+
+    // ids are per shard, the message says which one it came from
+    void ack(const Message<T> &msg) {
+        shards[msg.shardId]->ack(msg.id);
+    }
+
+    // the whole batch goes to one shard, the next one round-robin
+    void publishBatch(span<const T> payloads, chrono::milliseconds ttl, int priority = 0) {
+        shards[nextShard()]->publishBatch(payloads, ttl, priority);
+    }
+
+    void publishBatch(const string &key, span<const T> payloads, chrono::milliseconds ttl, int priority = 0) {
+        shards[hash<string>{}(key) % shards.size()]->publishBatch(payloads, ttl, priority);
+    }
+
+    // up to maxN messages, from the home shard first and then stolen from the others;
+    // waits at most timeout for the first one
+    vector<Message<T>> consumeBatch(size_t maxN, chrono::milliseconds timeout) {
+        size_t home = homeShard();
+        vector<Message<T>> batch;
+        auto gather = [&]{
+            for(size_t i = 0; i < shards.size() && batch.size() < maxN; i++) {
+                shards[(home + i) % shards.size()]->tryConsumeBatch(batch, maxN - batch.size());
+            }
+            return !batch.empty();
+        };
+        ready.waitUntil(gather, chrono::steady_clock::now() + timeout);
+        return batch;
+    }
+
+    // one view per shard, in shard order, to spot the saturated ones
+    vector<ShardStats> stats() {
+        vector<ShardStats> all;
+        for(auto &shard : shards) all.push_back(shard->stats());
+        return all;
+    }
+
+    // up to maxN, shard by shard
+    vector<Message<T>> drainDeadLetters(size_t maxN) {
+        vector<Message<T>> drained;
+        for(auto &shard : shards) {
+            if(drained.size() >= maxN) break;
+            for(auto &msg : shard->drainDeadLetters(maxN - drained.size())) drained.push_back(move(msg));
+        }
+        return drained;
+    }
+
+    // one ackBatch per shard involved
+    void ackBatch(const vector<Message<T>> &messages) {
+        vector<vector<uint64_t>> idsByShard(shards.size());
+        for(auto &msg : messages) idsByShard[msg.shardId].push_back(msg.id);
+        for(size_t i = 0; i < shards.size(); i++) {
+            if(!idsByShard[i].empty()) shards[i]->ackBatch(idsByShard[i]);
+        }
+    }
+};
+
+// every group sees every message. Messages are stored once, in a ring shared by all groups;
+// each group has its own read cursor, in-flight deliveries and ack state, so its consumers
+// compete with each other but not with other groups. A slot is reused only once every
+// group has acked past it, so the slowest group decides retention and publish blocks while
+// it is capacity messages behind. Message ids are offsets in the ring.
+template <typename T>
+class FanoutQueue {
+    struct alignas(64) Group {
+        string name;
+        mutex mux;
+        // next offset this group has never been handed
+        uint64_t cursor = 0;
+        // lowest offset this group has not acked; read by publishers without the lock
+        atomic<uint64_t> committed{0};
+        // acked[i] says whether committed + i is acked, up to the cursor
+        deque<bool> acked;
+        // handed out and not acked yet, deadline order since every delivery gets the same
+        // visibility timeout. Acked ones are skipped when they reach the front
+        deque<pair<uint64_t, chrono::steady_clock::time_point>> inFlight;
+        // redelivered offsets only
+        unordered_map<uint64_t, int> retries;
+        deque<Message<T>> deadLetters;
+    };
+
+    vector<Message<T>> slots;
+    vector<unique_ptr<Group>> groups;
+    RedeliveryPolicy policy;
+
+    mutex publishMux;
+    atomic<uint64_t> tail{0};
+
+    // rung on every publish, and whenever a group acks past the oldest messages
+    Doorbell published;
+    Doorbell freed;
+
+    uint64_t oldestRetained() {
+        uint64_t oldest = UINT64_MAX;
+        for(auto &group : groups) oldest = min(oldest, group->committed.load(memory_order_acquire));
+        return oldest;
+    }
+
+    // caller holds the group's lock; true if committed moved
+    bool markAcked(Group &group, uint64_t offset) {
+        uint64_t committed = group.committed.load(memory_order_relaxed);
+        if(offset < committed || offset >= group.cursor) return false;
+        group.acked[offset - committed] = true;
+        group.retries.erase(offset);
+        if(offset != committed) return false;
+
+        while(!group.acked.empty() && group.acked.front()) {
+            group.acked.pop_front();
+            committed++;
+        }
+        // pairs with oldestRetained(): the slots below are no longer read by this group
+        group.committed.store(committed, memory_order_release);
+        return true;
+    }
+
+    bool isAcked(Group &group, uint64_t offset) {
+        uint64_t committed = group.committed.load(memory_order_relaxed);
+        return offset < committed || group.acked[offset - committed];
+    }
+
+    // caller holds the group's lock
+    bool tryConsumeLocked(Group &group, Message<T> &out, bool &isFreed) {
+        auto now = chrono::steady_clock::now();
+
+        // deliveries whose visibility ran out go first, they are the oldest
+        while(!group.inFlight.empty()) {
+            auto [offset, deadline] = group.inFlight.front();
+            if(isAcked(group, offset)) {
+                group.inFlight.pop_front();
+                continue;
+            }
+            if(deadline > now) break;
+            group.inFlight.pop_front();
+
+            int retryCount = group.retries[offset];
+            if(retryCount >= policy.maxRetries) {
+                Message<T> dead = slots[offset % slots.size()];
+                dead.retryCount = retryCount;
+                group.deadLetters.push_back(move(dead));
+                isFreed |= markAcked(group, offset);
+                continue;
+            }
+            group.retries[offset] = retryCount + 1;
+            out = slots[offset % slots.size()];
+            out.retryCount = retryCount + 1;
+            out.deliveryTime = now;
+            group.inFlight.emplace_back(offset, now + policy.visibilityTimeout);
+            return true;
+        }
+
+        while(group.cursor < tail.load(memory_order_acquire)) {
+            uint64_t offset = group.cursor++;
+            group.acked.push_back(false);
+            const Message<T> &msg = slots[offset % slots.size()];
+            if(msg.expiryTime <= now) {
+                isFreed |= markAcked(group, offset);
+                continue;
+            }
+            out = msg;
+            out.deliveryTime = now;
+            group.inFlight.emplace_back(offset, now + policy.visibilityTimeout);
+            return true;
+        }
+        return false;
+    }
+
+    bool tryPublishBody(const Payload<T> &body, chrono::milliseconds ttl) {
+        {
+            lock_guard<mutex> lock(publishMux);
+            uint64_t offset = tail.load(memory_order_relaxed);
+            if(offset - oldestRetained() >= slots.size()) return false;
+
+            Message<T> &msg = slots[offset % slots.size()];
+            msg.id = offset;
+            msg.payload = body;
+            msg.enqueueTime = chrono::steady_clock::now();
+            msg.ttl = ttl;
+            msg.expiryTime = msg.enqueueTime + ttl;
+            msg.retryCount = 0;
+            tail.store(offset + 1, memory_order_release);
+        }
+        published.ring();
+        return true;
+    }
+
+public:
+    // groups are fixed up front; at least one is needed to hold on to anything
+    FanoutQueue(const vector<string> &groupNames, size_t capacity, RedeliveryPolicy policy = {}) :
+        slots(max(capacity, (size_t)1)),
+        policy(policy) {
+        for(const string &name : groupNames) {
+            groups.push_back(make_unique<Group>());
+            groups.back()->name = name;
+        }
+        if(groups.empty()) {
+            groups.push_back(make_unique<Group>());
+            groups.back()->name = "default";
+        }
+    }
+
+    // -1 if there is no such group
+    int groupId(const string &name) const {
+        for(size_t i = 0; i < groups.size(); i++) {
+            if(groups[i]->name == name) return (int)i;
+        }
+        return -1;
+    }
+
+    size_t groupCount() const { return groups.size(); }
+
+    // stored once whatever the number of groups; blocks while the slowest group is a full
+    // ring behind
+    void publish(T payload, chrono::milliseconds ttl) {
+        Payload<T> body(move(payload));
+        freed.waitUntil([&]{ return tryPublishBody(body, ttl); });
+    }
+
+    // false if the slowest group is a full ring behind
+    bool tryPublish(T payload, chrono::milliseconds ttl) {
+        return tryPublishBody(Payload<T>(move(payload)), ttl);
+    }
+
+    // the group's next message: a timed out delivery first, then the oldest it has not seen.
+    // false if there is none
+    bool tryConsume(int groupId, Message<T> &out) {
+        Group &group = *groups[groupId];
+        bool isFreed = false;
+        bool found;
+        {
+            lock_guard<mutex> lock(group.mux);
+            found = tryConsumeLocked(group, out, isFreed);
+        }
+        if(isFreed) freed.ring();
+        return found;
+    }
+
+    Message<T> consume(int groupId) {
+        // publishes ring the doorbell, timeouts do not, so sleep no longer than a tick
+        auto tick = clamp(policy.visibilityTimeout / 4, chrono::milliseconds(1), chrono::milliseconds(100));
+        Message<T> msg;
+        while(!published.waitUntil([&]{ return tryConsume(groupId, msg); }, chrono::steady_clock::now() + tick)) {}
+        return msg;
+    }
+
+    // acks for this group only; a no-op if it was already acked or dead-lettered
+    void ack(int groupId, const Message<T> &msg) {
+        Group &group = *groups[groupId];
+        bool isFreed;
+        {
+            lock_guard<mutex> lock(group.mux);
+            isFreed = markAcked(group, msg.id);
+        }
+        if(isFreed) freed.ring();
+    }
+
+    // messages published that the group has not acked yet
+    uint64_t lag(int groupId) {
+        return tail.load(memory_order_acquire) - groups[groupId]->committed.load(memory_order_acquire);
+    }
+
+    vector<Message<T>> drainDeadLetters(int groupId, size_t maxN) {
+        Group &group = *groups[groupId];
+        lock_guard<mutex> lock(group.mux);
+        size_t count = min(maxN, group.deadLetters.size());
+        vector<Message<T>> drained(make_move_iterator(group.deadLetters.begin()), make_move_iterator(group.deadLetters.begin() + count));
+        group.deadLetters.erase(group.deadLetters.begin(), group.deadLetters.begin() + count);
+        return drained;
+    }
+};
+
+enum class FsyncPolicy {
+    EveryBatch,     // publish returns once its records are fsynced; publishes waiting together share one fsync
+    Async           // fsync once per flush interval, a crash loses at most one interval
+};
+
+struct DurabilityOptions {
+    string dir;
+    FsyncPolicy fsyncPolicy = FsyncPolicy::EveryBatch;
+    chrono::milliseconds flushInterval = chrono::milliseconds(100);
+    // a new segment is started once the current one would grow past this
+    size_t segmentBytes = 64 << 20;
+};
+
+// a logged message; payload points straight into the mapped segment and stays valid until
+// the message is acked
+struct LogRef {
+    uint64_t offset = 0;
+    string_view payload;
+};
+
+uint32_t checksumOf(const char *data, size_t len, uint64_t offset) {
+    // FNV-1a over the offset and payload, enough to spot a torn tail after a crash
+    uint32_t h = 2166136261u;
+    for(size_t i = 0; i < sizeof(offset); i++) h = (h ^ (uint8_t)(offset >> (8 * i))) * 16777619u;
+    for(size_t i = 0; i < len; i++) h = (h ^ (uint8_t)data[i]) * 16777619u;
+    return h;
+}
+
+string readFile(const string &path) {
+    string buf;
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) return buf;
+
+    char chunk[4096];
+    ssize_t n;
+    while((n = read(fd, chunk, sizeof(chunk))) > 0) buf.append(chunk, n);
+    close(fd);
+    return buf;
+}
+
+// writes the whole buffer, fsyncs and renames into place so readers never see a partial file
+bool writeFileAtomically(const string &path, const string &buf) {
+    string tmpPath = path + ".tmp";
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) return false;
+
+    size_t done = 0;
+    while(done < buf.size()) {
+        ssize_t n = write(fd, buf.data() + done, buf.size() - done);
+        if(n <= 0) { close(fd); return false; }
+        done += n;
+    }
+    if(fsync(fd) != 0) {
+        close(fd);
+        return false;
+    }
+    close(fd);
+    return rename(tmpPath.c_str(), path.c_str()) == 0;
+}
+
+// append-only message log in size-rolled segment files. Appends go through pwrite; every
+// segment is also mapped read-only, so readers get payloads in place without a copy.
+// A single flusher thread fsyncs for everyone (group commit) and persists the committed
+// offset, the lowest unacked one. Restart resumes from there, so a message acked out of
+// order may be delivered again, but none is lost.
+class SegmentedLog {
+    struct Segment {
+        uint64_t baseOffset;
+        string path;
+        int fd = -1;
+        char *data = nullptr;
+        size_t capacity = 0;
+        // bytes and records written so far; readers only look below these
+        atomic<size_t> size{0};
+        atomic<uint64_t> endOffset{0};
+
+        ~Segment() {
+            if(data) munmap(data, capacity);
+            if(fd >= 0) close(fd);
+        }
+    };
+
+    // followed by the payload
+    struct RecordHeader {
+        uint32_t length;
+        uint32_t checksum;
+        uint64_t offset;
+    };
+
+    DurabilityOptions options;
+    bool opened = false;
+
+    // oldest first, the last one is appended to
+    mutex appendMux;
+    deque<unique_ptr<Segment>> segments;
+    uint64_t nextOffset = 0;
+
+    // records below readableOffset can be handed to consumers: written ones under Async,
+    // fsynced ones under EveryBatch
+    atomic<uint64_t> readableOffset{0};
+
+    // the single read cursor, see drainReadable()
+    mutex readMux;
+    Segment *readSegment = nullptr;
+    size_t readPos = 0;
+    uint64_t readOffset = 0;
+
+    mutex flushMux;
+    condition_variable flushCv;
+    condition_variable durableCv;
+    uint64_t durableOffset = 0;
+    uint64_t requestedOffset = 0;
+    bool shutDownFlag = false;
+    thread flusherThread;
+
+    // errno of the first failed write or fsync; from then on nothing is appended, since
+    // nextOffset may be past records that were never written, durableOffset and
+    // readableOffset stay put, and waitDurable fails
+    atomic<int> error{0};
+
+    // committed is the lowest unacked offset, acked[i] says whether committed + i is acked
+    mutex ackMux;
+    uint64_t committed = 0;
+    deque<bool> acked;
+    uint64_t persistedCommitted = 0;
+    chrono::steady_clock::time_point persistedAt;
+
+    string segmentPath(uint64_t base) {
+        char name[64];
+        snprintf(name, sizeof(name), "/segment-%020llu.log", (unsigned long long)base);
+        return options.dir + name;
+    }
+
+    string committedPath() { return options.dir + "/committed"; }
+
+    unique_ptr<Segment> openSegment(uint64_t base, size_t capacity, bool create) {
+        auto segment = make_unique<Segment>();
+        segment->baseOffset = base;
+        segment->path = segmentPath(base);
+        segment->fd = open(segment->path.c_str(), O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0644);
+        if(segment->fd < 0) return nullptr;
+
+        struct stat st;
+        fstat(segment->fd, &st);
+        // mapping past the end of the file is fine as long as nothing reads there
+        segment->capacity = max(capacity, (size_t)st.st_size);
+        void *data = mmap(nullptr, segment->capacity, PROT_READ, MAP_SHARED, segment->fd, 0);
+        if(data == MAP_FAILED) return nullptr;
+        segment->data = (char*)data;
+        segment->endOffset = base;
+        return segment;
+    }
+
+    // the first error sticks; wakes publishers waiting in waitDurable
+    void fail(int err) {
+        int none = 0;
+        error.compare_exchange_strong(none, err ? err : EIO);
+        lock_guard<mutex> lock(flushMux);
+        durableCv.notify_all();
+    }
+
+    // caller holds appendMux
+    bool roll(size_t recordBytes) {
+        if(!segments.empty() && fsync(segments.back()->fd) != 0) {
+            fail(errno);
+            return false;
+        }
+        auto segment = openSegment(nextOffset, max(options.segmentBytes, recordBytes), true);
+        if(!segment) {
+            fail(errno);
+            return false;
+        }
+        segments.push_back(move(segment));
+        return true;
+    }
+
+    // caller holds appendMux
+    bool writeOut(Segment &segment, const string &buf, uint64_t endOffset) {
+        size_t done = 0;
+        while(done < buf.size()) {
+            ssize_t n = pwrite(segment.fd, buf.data() + done, buf.size() - done, segment.size + done);
+            if(n <= 0) {
+                fail(n < 0 ? errno : EIO);
+                return false;
+            }
+            done += n;
+        }
+        segment.size.store(segment.size + buf.size(), memory_order_release);
+        segment.endOffset.store(endOffset, memory_order_release);
+        if(options.fsyncPolicy == FsyncPolicy::Async) readableOffset.store(endOffset, memory_order_release);
+        return true;
+    }
+
+    // walks a segment's valid records; false at the first torn or missing one. Empty payloads
+    // are valid records: a zeroed header never matches, since the checksum covers the offset
+    bool parseAt(const Segment &segment, size_t pos, size_t limit, uint64_t offset, LogRef &out) {
+        if(pos + sizeof(RecordHeader) > limit) return false;
+        RecordHeader header;
+        memcpy(&header, segment.data + pos, sizeof(header));
+        if(header.offset != offset || pos + sizeof(header) + header.length > limit) return false;
+
+        const char *payload = segment.data + pos + sizeof(header);
+        if(header.checksum != checksumOf(payload, header.length, offset)) return false;
+        out = LogRef{offset, string_view(payload, header.length)};
+        return true;
+    }
+
+    void recover() {
+        unsigned long long savedCommitted = 0;
+        sscanf(readFile(committedPath()).c_str(), "%llu", &savedCommitted);
+        committed = persistedCommitted = savedCommitted;
+
+        vector<uint64_t> bases;
+        for(auto &entry : filesystem::directory_iterator(options.dir)) {
+            unsigned long long base;
+            if(sscanf(entry.path().filename().string().c_str(), "segment-%llu.log", &base) == 1) bases.push_back(base);
+        }
+        sort(bases.begin(), bases.end());
+
+        bool isTorn = false;
+        for(uint64_t base : bases) {
+            // nothing after a torn record can be trusted
+            if(isTorn || base != (segments.empty() ? base : nextOffset)) {
+                filesystem::remove(segmentPath(base));
+                continue;
+            }
+
+            auto segment = openSegment(base, options.segmentBytes, false);
+            if(!segment) {
+                isTorn = true;
+                continue;
+            }
+
+            struct stat st;
+            fstat(segment->fd, &st);
+            size_t pos = 0;
+            uint64_t offset = base;
+            LogRef ref;
+            while(parseAt(*segment, pos, st.st_size, offset, ref)) {
+                pos += sizeof(RecordHeader) + ref.payload.size();
+                offset++;
+            }
+            if(pos < (size_t)st.st_size) {
+                isTorn = true;
+                if(ftruncate(segment->fd, pos) != 0) continue;
+            }
+
+            segment->size = pos;
+            segment->endOffset = offset;
+            nextOffset = offset;
+            segments.push_back(move(segment));
+        }
+
+        // a crash under Async can lose records that were already acked
+        if(committed > nextOffset) {
+            for(auto &segment : segments) filesystem::remove(segment->path);
+            segments.clear();
+            nextOffset = committed;
+        }
+        if(segments.empty() && !roll(0)) return;
+
+        durableOffset = requestedOffset = nextOffset;
+        readableOffset = nextOffset;
+
+        // start reading at the committed offset
+        readSegment = segments.front().get();
+        for(auto &segment : segments) {
+            if(segment->baseOffset <= committed) readSegment = segment.get();
+        }
+        readOffset = readSegment->baseOffset;
+        LogRef ref;
+        while(readOffset < committed && parseAt(*readSegment, readPos, readSegment->size, readOffset, ref)) {
+            readPos += sizeof(RecordHeader) + ref.payload.size();
+            readOffset++;
+        }
+    }
+
+    void flusherWorker() {
+        while(true) {
+            bool isShuttingDown;
+            {
+                unique_lock<mutex> lock(flushMux);
+                flushCv.wait_for(lock, options.flushInterval, [&]{return shutDownFlag || requestedOffset > durableOffset;});
+                isShuttingDown = shutDownFlag;
+            }
+
+            int fd;
+            uint64_t target;
+            {
+                lock_guard<mutex> lock(appendMux);
+                fd = segments.back()->fd;
+                target = nextOffset;
+            }
+            bool isBehind;
+            {
+                lock_guard<mutex> lock(flushMux);
+                isBehind = target > durableOffset;
+            }
+            if(isBehind && !error.load()) {
+                // earlier segments were fsynced when they were rolled
+                if(fsync(fd) != 0) {
+                    fail(errno);
+                } else {
+                    {
+                        lock_guard<mutex> lock(flushMux);
+                        durableOffset = max(durableOffset, target);
+                    }
+                    if(options.fsyncPolicy == FsyncPolicy::EveryBatch) readableOffset.store(target, memory_order_release);
+                    durableCv.notify_all();
+                }
+            }
+
+            // at most once per interval, it costs a file write and an fsync of its own
+            if(isShuttingDown || chrono::steady_clock::now() - persistedAt >= options.flushInterval) persistCommitted();
+            if(isShuttingDown) return;
+        }
+    }
+
+    // writes the committed offset out and deletes the segments it has passed; runs on the
+    // flusher thread only, so no fd it is syncing can be closed under it
+    void persistCommitted() {
+        uint64_t current;
+        {
+            lock_guard<mutex> lock(ackMux);
+            current = committed;
+        }
+        persistedAt = chrono::steady_clock::now();
+        if(current == persistedCommitted) return;
+        // the segments stay until the committed offset that covers them is on disk
+        if(!writeFileAtomically(committedPath(), to_string(current) + "\n")) return;
+        persistedCommitted = current;
+
+        vector<unique_ptr<Segment>> retired;
+        {
+            lock_guard<mutex> readLock(readMux);
+            lock_guard<mutex> lock(appendMux);
+            while(segments.size() > 1 && segments.front()->endOffset <= current && segments.front().get() != readSegment) {
+                retired.push_back(move(segments.front()));
+                segments.pop_front();
+            }
+        }
+        for(auto &segment : retired) filesystem::remove(segment->path);
+    }
+
+public:
+    explicit SegmentedLog(const DurabilityOptions &options) : options(options) {
+        filesystem::create_directories(options.dir);
+        recover();
+        opened = !segments.empty();
+        flusherThread = thread(&SegmentedLog::flusherWorker, this);
+    }
+
+    ~SegmentedLog() {
+        {
+            lock_guard<mutex> lock(flushMux);
+            shutDownFlag = true;
+        }
+        flushCv.notify_all();
+        flusherThread.join();
+    }
+
+    bool isOpen() const { return opened; }
+
+    bool hasFailed() const { return error.load() != 0; }
+
+    // appends the batch with one write per segment touched; returns the offset after the last
+    // record, or 0 if the write failed, which also fails the log for good. A batch that spans
+    // segments can fail after its first segment's part was written: that part is in the log
+    // and comes back after a restart, so retrying the whole batch can duplicate messages.
+    uint64_t append(span<const string_view> payloads) {
+        lock_guard<mutex> lock(appendMux);
+        if(error.load()) return 0;
+        string buf;
+        for(string_view payload : payloads) {
+            size_t recordBytes = sizeof(RecordHeader) + payload.size();
+            Segment *segment = segments.back().get();
+            if(segment->size + buf.size() + recordBytes > segment->capacity) {
+                if(!buf.empty() && !writeOut(*segment, buf, nextOffset)) return 0;
+                buf.clear();
+                if(!roll(recordBytes)) return 0;
+            }
+
+            RecordHeader header{(uint32_t)payload.size(), checksumOf(payload.data(), payload.size(), nextOffset), nextOffset};
+            buf.append((const char*)&header, sizeof(header));
+            buf.append(payload);
+            nextOffset++;
+        }
+        if(!buf.empty() && !writeOut(*segments.back(), buf, nextOffset)) return 0;
+        return nextOffset;
+    }
+
+    // under EveryBatch, blocks until every record before end is fsynced; false if the log
+    // failed before they were
+    bool waitDurable(uint64_t end) {
+        unique_lock<mutex> lock(flushMux);
+        if(durableOffset >= end) return true;
+        if(options.fsyncPolicy != FsyncPolicy::EveryBatch) return !error.load();
+        requestedOffset = max(requestedOffset, end);
+        flushCv.notify_one();
+        durableCv.wait(lock, [&]{return durableOffset >= end || error.load();});
+        return durableOffset >= end;
+    }
+
+    // feeds readable records, in order, to accept until it returns false; the record it
+    // refused is offered again next time
+    template <typename Accept>
+    size_t drainReadable(Accept &&accept) {
+        lock_guard<mutex> lock(readMux);
+        size_t count = 0;
+        while(readOffset < readableOffset.load(memory_order_acquire)) {
+            if(readOffset >= readSegment->endOffset.load(memory_order_acquire)) {
+                // this segment is done, the next one starts at readOffset
+                lock_guard<mutex> appendLock(appendMux);
+                for(auto &segment : segments) {
+                    if(segment->baseOffset == readOffset) readSegment = segment.get();
+                }
+                readPos = 0;
+            }
+
+            LogRef ref;
+            if(!parseAt(*readSegment, readPos, readSegment->size.load(memory_order_acquire), readOffset, ref)) break;
+            if(!accept(ref)) break;
+            readPos += sizeof(RecordHeader) + ref.payload.size();
+            readOffset++;
+            count++;
+        }
+        return count;
+    }
+
+    void ack(uint64_t offset) {
+        lock_guard<mutex> lock(ackMux);
+        if(offset < committed) return;
+        size_t index = offset - committed;
+        if(index >= acked.size()) acked.resize(index + 1, false);
+        acked[index] = true;
+        while(!acked.empty() && acked.front()) {
+            acked.pop_front();
+            committed++;
+        }
+    }
+};
+
+// a queue whose messages live in a SegmentedLog. The shard only holds LogRefs and is topped
+// up from the log as consumers make room, so the backlog is bounded by disk rather than by
+// the shard's capacity. Durable messages never expire.
+class DurableQueue {
+    SegmentedLog log;
+    Doorbell ready;
+    Queue_shard<LogRef> shard;
+
+    static constexpr chrono::milliseconds noExpiry = chrono::hours(24 * 365 * 100);
+
+    void pump() {
+        log.drainReadable([&](const LogRef &ref) { return shard.tryPublish(ref, noExpiry); });
+    }
+
+public:
+    // replays every unacked message left in options.dir
+    DurableQueue(const DurabilityOptions &options, int capacity, RedeliveryPolicy policy = {}) :
+        log(options),
+        shard(capacity, 0, policy, &ready) {
+        pump();
+    }
+
+    bool isOpen() const { return log.isOpen(); }
+
+    // false if the message could not be logged, see publishBatch
+    bool publish(string_view payload) {
+        return publishBatch(span<const string_view>(&payload, 1));
+    }
+
+    // one write and, under EveryBatch, one shared fsync for the whole batch; false if the
+    // log could not be written or, under EveryBatch, synced
+    bool publishBatch(span<const string_view> payloads) {
+        uint64_t end = log.append(payloads);
+        if(!end) return false;
+        bool isDurable = log.waitDurable(end);
+        pump();
+        return isDurable;
+    }
+
+    // the payload is read in place from the mapped log
+    Message<LogRef> consume() {
+        Message<LogRef> msg;
+        ready.waitUntil([&]{
+            pump();
+            return shard.tryConsume(msg);
+        });
+        return msg;
+    }
+
+    // a late ack, after the message already timed out, is ignored: the redelivery may still
+    // be queued and must keep its segment alive
+    void ack(const Message<LogRef> &msg) {
+        if(shard.ack(msg.id)) log.ack(msg.payload->offset);
+    }
+
+    // copied out, since the log may drop a segment once all of it is acked
+    vector<string> drainDeadLetters(size_t maxN) {
+        vector<string> payloads;
+        for(auto &msg : shard.drainDeadLetters(maxN)) {
+            payloads.push_back(string(msg.payload->payload));
+            log.ack(msg.payload->offset);
+        }
+        return payloads;
+    }
+};
+
+void printStats(const string &name, const ShardStats &stats) {
+    cout << name << ": depth=";
+    for(size_t i = 0; i < stats.depth.size(); i++) cout << (i ? "/" : "") << stats.depth[i];
+    cout << " of " << stats.laneCapacity
+         << " inFlight=" << stats.inFlight << " scheduled=" << stats.scheduled << " deadLetters=" << stats.deadLetters
+         << " enqueued=" << stats.enqueued << " dequeued=" << stats.dequeued
+         << " redelivered=" << stats.redelivered << " ttlDrops=" << stats.ttlDrops
+         << " blockedPublishes=" << stats.blockedPublishes
+         << " blockedMs=" << chrono::duration_cast<chrono::milliseconds>(stats.producerBlocked).count()
+         << " publishTimeouts=" << stats.publishTimeouts
+         << " latencyUs p50<" << stats.latencyPercentileUs(0.5) << " p99<" << stats.latencyPercentileUs(0.99) << endl;
+}
+
+// publish + consume + ack throughput of one shard on each storage; batch > 1 uses the
+// batch calls with that many messages per call
+template <typename Buffer>
+void benchmarkShard(const char *name, int producers, int consumers, int messages, int batch) {
+    Queue_shard<uint64_t, Buffer> shard(1024, 0);
+    int perProducer = messages / producers;
+    int perConsumer = perProducer * producers / consumers;
+    atomic<int> consumed{0};
+
+    vector<thread> threads;
+    auto start = chrono::steady_clock::now();
+
+    for(int p = 0; p < producers; p++) {
+        threads.emplace_back([&]{
+            if(batch == 1) {
+                for(int i = 0; i < perProducer; i++) shard.publish(i, chrono::minutes(5));
+                return;
+            }
+            vector<uint64_t> payloads(batch);
+            for(int i = 0; i < perProducer; i += batch) {
+                size_t count = min(batch, perProducer - i);
+                shard.publishBatch(span<const uint64_t>(payloads.data(), count), chrono::minutes(5));
+            }
+        });
+    }
+    for(int c = 0; c < consumers; c++) {
+        threads.emplace_back([&]{
+            if(batch == 1) {
+                for(int i = 0; i < perConsumer; i++) shard.ack(shard.consume().id);
+                return;
+            }
+            vector<uint64_t> ids;
+            while(consumed.load(memory_order_relaxed) < perConsumer * consumers) {
+                auto msgs = shard.consumeBatch(batch, chrono::milliseconds(10));
+                ids.clear();
+                for(auto &msg : msgs) ids.push_back(msg.id);
+                shard.ackBatch(ids);
+                consumed.fetch_add(msgs.size(), memory_order_relaxed);
+            }
+        });
+    }
+    for(auto &t : threads) t.join();
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "  " << name << " msgs/sec=" << (uint64_t)(perConsumer * consumers / seconds) << "\n";
+}
+
+void runShardBenchmark(int producers, int consumers, int messages, int batch) {
+    // consumers must be able to drain exactly what producers publish
+    messages -= messages % (producers * consumers);
+    cout << "producers=" << producers << " consumers=" << consumers << " messages=" << messages << " batch=" << batch << "\n";
+    benchmarkShard<DequeBuffer<Message<uint64_t>>>("deque", producers, consumers, messages, batch);
+    benchmarkShard<RingBuffer<Message<uint64_t>>>("ring ", producers, consumers, messages, batch);
+}
+
+// the same load through a MessageQueue with 1 shard and with shardCount shards
+void runQueueBenchmark(int producers, int consumers, size_t shardCount, int messages) {
+    messages -= messages % (producers * consumers);
+    cout << "producers=" << producers << " consumers=" << consumers << " messages=" << messages << "\n";
+
+    for(size_t shards : {(size_t)1, shardCount}) {
+        MessageQueue<uint64_t> queue(shards, 1024);
+        int perProducer = messages / producers;
+        int perConsumer = messages / consumers;
+
+        vector<thread> threads;
+        auto start = chrono::steady_clock::now();
+        for(int p = 0; p < producers; p++) {
+            threads.emplace_back([&]{
+                for(int i = 0; i < perProducer; i++) queue.publish(i, chrono::minutes(5));
+            });
+        }
+        for(int c = 0; c < consumers; c++) {
+            threads.emplace_back([&]{
+                for(int i = 0; i < perConsumer; i++) queue.ack(queue.consume());
+            });
+        }
+        for(auto &t : threads) t.join();
+
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "  shards=" << shards << " msgs/sec=" << (uint64_t)(messages / seconds) << "\n";
+    }
+}
+
+// publish + consume + ack throughput of a DurableQueue under each fsync policy, with
+// payloadBytes per message and batch messages per publish call
+void runDurableBenchmark(int producers, int messages, size_t payloadBytes, int batch) {
+    messages -= messages % (producers * batch);
+    cout << "producers=" << producers << " messages=" << messages << " payloadBytes=" << payloadBytes << " batch=" << batch << "\n";
+
+    for(FsyncPolicy policy : {FsyncPolicy::EveryBatch, FsyncPolicy::Async}) {
+        DurabilityOptions options;
+        options.dir = (filesystem::temp_directory_path() / ("mq-bench-" + to_string(getpid()))).string();
+        options.fsyncPolicy = policy;
+        options.segmentBytes = 16 << 20;
+        filesystem::remove_all(options.dir);
+        {
+            DurableQueue queue(options, 1024);
+            if(!queue.isOpen()) {
+                cout << "  could not open " << options.dir << "\n";
+                return;
+            }
+            string payload(payloadBytes, 'x');
+            vector<string_view> payloads(batch, payload);
+            int perProducer = messages / producers;
+
+            vector<thread> threads;
+            auto start = chrono::steady_clock::now();
+            for(int p = 0; p < producers; p++) {
+                threads.emplace_back([&]{
+                    for(int i = 0; i < perProducer; i += batch) queue.publishBatch(payloads);
+                });
+            }
+            threads.emplace_back([&]{
+                for(int i = 0; i < messages; i++) queue.ack(queue.consume());
+            });
+            for(auto &t : threads) t.join();
+
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cout << "  " << (policy == FsyncPolicy::EveryBatch ? "fsync-per-batch" : "async         ")
+                 << " msgs/sec=" << (uint64_t)(messages / seconds)
+                 << " MB/sec=" << (uint64_t)(messages * payloadBytes / seconds / (1 << 20)) << "\n";
+        }
+        filesystem::remove_all(options.dir);
+    }
+}
+
+// latency of urgent messages published every 200us while lowProducers keep the shard's
+// bulk traffic at full capacity, with everything in one FIFO lane and with a lane of its own
+void runPriorityBenchmark(int lowProducers, int urgentMessages) {
+    cout << "lowProducers=" << lowProducers << " urgentMessages=" << urgentMessages << "\n";
+
+    for(size_t lanes : {(size_t)1, (size_t)2}) {
+        Queue_shard<uint64_t> shard(4096, 0, {}, nullptr, PriorityPolicy{lanes, {}});
+        int urgent = (int)lanes - 1;
+        atomic<bool> done{false};
+        auto nowNs = []{ return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count(); };
+
+        vector<thread> threads;
+        for(int p = 0; p < lowProducers; p++) {
+            threads.emplace_back([&]{
+                while(!done.load(memory_order_relaxed)) {
+                    if(!shard.tryPublish(0, chrono::minutes(5))) this_thread::yield();
+                }
+            });
+        }
+        // let the backlog build up
+        this_thread::sleep_for(chrono::milliseconds(50));
+
+        vector<uint64_t> latencies;
+        thread consumer([&]{
+            while((int)latencies.size() < urgentMessages) {
+                Message<uint64_t> msg = shard.consume();
+                if(*msg.payload) latencies.push_back(nowNs() - *msg.payload);
+                shard.ack(msg.id);
+            }
+        });
+        for(int i = 0; i < urgentMessages; i++) {
+            shard.publish(nowNs(), chrono::minutes(5), urgent);
+            this_thread::sleep_for(chrono::microseconds(200));
+        }
+        consumer.join();
+        done = true;
+        for(auto &t : threads) t.join();
+
+        sort(latencies.begin(), latencies.end());
+        auto at = [&](double q) { return latencies[min(latencies.size() - 1, (size_t)(q * latencies.size()))] / 1000; };
+        cout << "  lanes=" << lanes << " urgent latency us p50=" << at(0.5) << " p99=" << at(0.99) << " max=" << latencies.back() / 1000 << "\n";
+    }
+}
+
+// every group consuming every message: publishing a copy per group into a shard each,
+// against one FanoutQueue with a cursor per group
+void runFanoutBenchmark(int groups, int messages, size_t payloadBytes) {
+    cout << "groups=" << groups << " messages=" << messages << " payloadBytes=" << payloadBytes << "\n";
+    string payload(payloadBytes, 'x');
+    auto report = [&](const char *name, chrono::steady_clock::time_point start, size_t storedBytes) {
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "  " << name << " deliveries/sec=" << (uint64_t)((double)messages * groups / seconds)
+             << " payload bytes stored per message=" << storedBytes << "\n";
+    };
+
+    {
+        vector<unique_ptr<Queue_shard<string>>> shards;
+        for(int g = 0; g < groups; g++) shards.push_back(make_unique<Queue_shard<string>>(1024, g));
+        vector<thread> threads;
+        auto start = chrono::steady_clock::now();
+        for(int g = 0; g < groups; g++) {
+            threads.emplace_back([&, g]{
+                for(int i = 0; i < messages; i++) shards[g]->ack(shards[g]->consume().id);
+            });
+        }
+        for(int i = 0; i < messages; i++) {
+            for(auto &shard : shards) shard->publish(payload, chrono::minutes(5));
+        }
+        for(auto &t : threads) t.join();
+        report("copy per group", start, payloadBytes * groups);
+    }
+
+    {
+        vector<string> names;
+        for(int g = 0; g < groups; g++) names.push_back("group" + to_string(g));
+        FanoutQueue<string> queue(names, 1024);
+        vector<thread> threads;
+        auto start = chrono::steady_clock::now();
+        for(int g = 0; g < groups; g++) {
+            threads.emplace_back([&, g]{
+                for(int i = 0; i < messages; i++) queue.ack(g, queue.consume(g));
+            });
+        }
+        for(int i = 0; i < messages; i++) queue.publish(payload, chrono::minutes(5));
+        for(auto &t : threads) t.join();
+        report("fanout        ", start, payloadBytes);
+    }
+}
+
+// thousands of consumer coroutines and a few producer coroutines sharing poolThreads
+// threads through co_consume/co_publish; each consumer stops at its own end marker
+void runCoroutineBenchmark(int consumers, int poolThreads, int messages, int producers) {
+    messages -= messages % producers;
+    cout << "consumers=" << consumers << " poolThreads=" << poolThreads << " messages=" << messages << " producers=" << producers << "\n";
+
+    const uint64_t endMarker = UINT64_MAX;
+    Queue_shard<uint64_t> shard(1024, 0);
+    latch finished(consumers + producers);
+    {
+        CoroutinePool pool(poolThreads);
+        auto start = chrono::steady_clock::now();
+
+        auto consumer = [&]() -> DetachedTask {
+            co_await pool.schedule();
+            while(true) {
+                Message<uint64_t> msg = co_await shard.co_consume(pool);
+                shard.ack(msg.id);
+                if(*msg.payload == endMarker) break;
+            }
+            finished.count_down();
+        };
+        auto producer = [&](int count) -> DetachedTask {
+            co_await pool.schedule();
+            for(int i = 0; i < count; i++) co_await shard.co_publish(pool, i, chrono::minutes(5));
+            finished.count_down();
+        };
+
+        for(int c = 0; c < consumers; c++) consumer();
+        for(int p = 0; p < producers; p++) producer(messages / producers);
+        // one end marker per consumer once the real messages are in
+        thread([&]{
+            while(shard.stats().enqueued < (uint64_t)messages) this_thread::sleep_for(chrono::milliseconds(1));
+            for(int c = 0; c < consumers; c++) shard.publish(endMarker, chrono::minutes(5));
+        }).join();
+        finished.wait();
+
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "  msgs/sec=" << (uint64_t)(messages / seconds) << " threads=" << poolThreads << "\n";
+    }
+}
+
+int main(int argc, char* argv[]) {
+    string mode = argc > 1 ? argv[1] : "";
+
+    if(mode == "bench") {
+        // ./main bench [producers] [consumers] [messages] [batch]
+        int producers = argc > 2 ? stoi(argv[2]) : 4;
+        int consumers = argc > 3 ? stoi(argv[3]) : 4;
+        int messages = argc > 4 ? stoi(argv[4]) : 2000000;
+        int batch = argc > 5 ? max(1, stoi(argv[5])) : 1;
+        runShardBenchmark(producers, consumers, messages, batch);
+        return 0;
+    }
+
+    if(mode == "bench-queue") {
+        // ./main bench-queue [producers] [consumers] [shardCount] [messages]
+        int producers = argc > 2 ? stoi(argv[2]) : 4;
+        int consumers = argc > 3 ? stoi(argv[3]) : 4;
+        size_t shardCount = argc > 4 ? stoul(argv[4]) : 8;
+        int messages = argc > 5 ? stoi(argv[5]) : 2000000;
+        runQueueBenchmark(producers, consumers, shardCount, messages);
+        return 0;
+    }
+
+    if(mode == "bench-durable") {
+        // ./main bench-durable [producers] [messages] [payloadBytes] [batch]
+        int producers = argc > 2 ? stoi(argv[2]) : 4;
+        int messages = argc > 3 ? stoi(argv[3]) : 200000;
+        size_t payloadBytes = argc > 4 ? stoul(argv[4]) : 128;
+        int batch = argc > 5 ? max(1, stoi(argv[5])) : 16;
+        runDurableBenchmark(producers, messages, payloadBytes, batch);
+        return 0;
+    }
+
+    if(mode == "bench-priority") {
+        // ./main bench-priority [lowProducers] [urgentMessages]
+        int lowProducers = argc > 2 ? stoi(argv[2]) : 2;
+        int urgentMessages = argc > 3 ? stoi(argv[3]) : 2000;
+        runPriorityBenchmark(lowProducers, urgentMessages);
+        return 0;
+    }
+
+    if(mode == "bench-coro") {
+        // ./main bench-coro [consumers] [poolThreads] [messages] [producers]
+        int consumers = argc > 2 ? max(1, stoi(argv[2])) : 10000;
+        int poolThreads = argc > 3 ? max(1, stoi(argv[3])) : 2;
+        int messages = argc > 4 ? stoi(argv[4]) : 1000000;
+        int producers = argc > 5 ? max(1, stoi(argv[5])) : 4;
+        runCoroutineBenchmark(consumers, poolThreads, messages, producers);
+        return 0;
+    }
+
+    if(mode == "bench-fanout") {
+        // ./main bench-fanout [groups] [messages] [payloadBytes]
+        int groups = argc > 2 ? max(1, stoi(argv[2])) : 4;
+        int messages = argc > 3 ? stoi(argv[3]) : 200000;
+        size_t payloadBytes = argc > 4 ? stoul(argv[4]) : 1024;
+        runFanoutBenchmark(groups, messages, payloadBytes);
+        return 0;
+    }
+
+    RedeliveryPolicy policy;
+    policy.visibilityTimeout = chrono::milliseconds(200);
+    policy.initialBackoff = chrono::milliseconds(50);
+    policy.maxRetries = 1;
+    Queue_shard<string> shard(16, 0, policy);
+
+    shard.publish("hello", chrono::seconds(10));
+    shard.publish("world", chrono::seconds(10));
+
+    Message<string> first = shard.consume();
+    cout << "Consumed: " << *first.payload << endl;
+    shard.ack(first.id);
+
+    Message<string> second = shard.consume();
+    cout << "Consumed without ack: " << *second.payload << endl;
+
+    Message<string> again = shard.consume();
+    cout << "Redelivered: " << *again.payload << " retryCount=" << again.retryCount << endl;
+
+    // not acked again, and out of retries
+    this_thread::sleep_for(chrono::milliseconds(400));
+    for(auto &msg : shard.drainDeadLetters(10)) cout << "Dead letter: " << *msg.payload << " retryCount=" << msg.retryCount << endl;
+
+    // a full shard makes tryPublishFor give up instead of hanging the producer
+    Queue_shard<string> small(2, 1);
+    for(int i = 0; i < 3; i++) {
+        bool isPublished = small.tryPublishFor("load" + to_string(i), chrono::seconds(10), chrono::milliseconds(20));
+        cout << "tryPublishFor load" << i << ": " << (isPublished ? "published" : "shed") << endl;
+    }
+    printStats("Shard 0", shard.stats());
+    printStats("Shard 1", small.stats());
+
+    // messages with the same key keep their order
+    MessageQueue<string> queue(4, 16);
+    for(int i = 0; i < 3; i++) queue.publish("order-42", "step" + to_string(i), chrono::seconds(10));
+    for(int i = 0; i < 3; i++) {
+        Message<string> msg = queue.consume();
+        cout << "Queue consumed: " << *msg.payload << " from shard " << msg.shardId << endl;
+        queue.ack(msg);
+    }
+
+    // the urgent lane overtakes, the scheduled message waits for its time
+    Queue_shard<string> lanes(16, 0, {}, nullptr, PriorityPolicy{2, {}});
+    lanes.publishAfter("later", chrono::milliseconds(100), chrono::seconds(10));
+    lanes.publish("bulk", chrono::seconds(10));
+    lanes.publish("urgent", chrono::seconds(10), 1);
+    for(int i = 0; i < 3; i++) {
+        Message<string> msg = lanes.consume();
+        cout << "Lanes consumed: " << *msg.payload << " priority=" << msg.priority << endl;
+        lanes.ack(msg.id);
+    }
+
+    // both groups get every message, from one stored copy
+    FanoutQueue<string> fanout({"billing", "audit"}, 16);
+    fanout.publish("order-1", chrono::seconds(10));
+    fanout.publish("order-2", chrono::seconds(10));
+    for(const string &name : {string("billing"), string("audit")}) {
+        int group = fanout.groupId(name);
+        for(int i = 0; i < 2; i++) {
+            Message<string> msg = fanout.consume(group);
+            cout << name << " consumed: " << *msg.payload << endl;
+            fanout.ack(group, msg);
+        }
+    }
+    return 0;
+}
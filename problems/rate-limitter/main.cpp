@@ -2,67 +2,485 @@
 #include<unordered_map>
 #include<thread>
 #include<mutex>
+#include<condition_variable>
+#include<shared_mutex>
 #include<chrono>
+#include<atomic>
+#include<memory>
+#include<string>
+#include<vector>
+#include<random>
+#include<functional>
+#include<cmath>
+#include<algorithm>
+#include<cstdio>
+#include<unistd.h>
+#include<sys/wait.h>
+#ifdef __APPLE__
+#include<mach/mach.h>
+#endif
 
 using namespace std;
 
-struct Bucket {
+// the original bucket: every field behind its own mutex
+struct LockedBucket {
     int capacity;
     int tokens;
     int refillRate;
     chrono::steady_clock::time_point lastRefilledAt;
     mutex mux;
 
-    Bucket(int cap, int rate) : 
-        capacity(cap), 
+    LockedBucket(int cap, int rate) :
+        capacity(cap),
         tokens(rate),
         refillRate(rate),
-        lastRefilledAt(chrono::steady_clock::now()) 
+        lastRefilledAt(chrono::steady_clock::now())
     {}
 };
 
+// the whole state of a bucket in one word, tokens in the top bits and the last refill (ms
+// since the limiter started) in the low ones, so a decision is a single CAS
+struct Bucket {
+    static constexpr int timeBits = 44;
+    static constexpr uint64_t timeMask = (uint64_t(1) << timeBits) - 1;
+    static constexpr int maxTokens = (1 << (64 - timeBits)) - 1;
+
+    int capacity;
+    int refillRate;
+    atomic<uint64_t> state;
+
+    static uint64_t pack(uint64_t tokens, uint64_t ms) { return tokens << timeBits | (ms & timeMask); }
+
+    Bucket(int cap, int rate, uint64_t nowMs) :
+        capacity(cap),
+        refillRate(rate),
+        state(pack(rate, nowMs))
+    {}
+
+    uint64_t lastRefilledMs() const { return state.load(memory_order_relaxed) & timeMask; }
+
+    // same refill rule as LockedBucket, whole seconds only; takes cost tokens in one CAS
+    // and only retries when another request changed the bucket in between
+    bool tryTake(uint64_t nowMs, uint64_t cost) {
+        uint64_t current = state.load(memory_order_relaxed);
+        while(true) {
+            uint64_t tokens = current >> timeBits;
+            uint64_t last = current & timeMask;
+
+            uint64_t seconds = nowMs > last ? (nowMs - last) / 1000 : 0;
+            if(seconds > 0) {
+                tokens = min((uint64_t)capacity, tokens + seconds * refillRate);
+                last = nowMs;
+            }
+
+            if(tokens < cost) return false;
+            if(state.compare_exchange_weak(current, pack(tokens - cost, last), memory_order_relaxed)) return true;
+        }
+    }
+};
+
+// the token bucket as a GCRA: instead of tokens, the state is the theoretical arrival time
+// (tat) of the next request, in 1/16 ns since the limiter started. Tokens refill
+// continuously, and the only error is the rounding of the interval to 1/16 ns.
+struct GcraBucket {
+    static constexpr uint64_t unitsPerNs = 16;
+
+    atomic<uint64_t> tat;
+
+    explicit GcraBucket(uint64_t now) : tat(now) {}
+
+    // cost is the time the taken tokens take to refill; a request is allowed while it
+    // leaves tat at most horizon (the refill time of a full bucket) ahead of now
+    bool tryTake(uint64_t now, uint64_t cost, uint64_t horizon) {
+        uint64_t current = tat.load(memory_order_relaxed);
+        while(true) {
+            uint64_t next = max(current, now) + cost;
+            if(next - now > horizon) return false;
+            if(tat.compare_exchange_weak(current, next, memory_order_relaxed)) return true;
+        }
+    }
+
+    // once tat is behind now the bucket is full
+    uint64_t fullSince() const { return tat.load(memory_order_relaxed); }
+};
+
+// sliding-window counter: the count of the current fixed window plus the previous window's
+// count, weighted by how much of the previous window the sliding window still overlaps.
+// One word per key: the window number (low 24 bits) | previous count | current count.
+struct WindowCounter {
+    static constexpr int countBits = 20;
+    static constexpr uint64_t countMask = (1ull << countBits) - 1;
+    static constexpr uint64_t windowMask = (1ull << (64 - 2 * countBits)) - 1;
+    static constexpr uint64_t maxCount = countMask;
+
+    atomic<uint64_t> state;
+
+    static uint64_t pack(uint64_t window, uint64_t previous, uint64_t current) {
+        return (window & windowMask) << (2 * countBits) | previous << countBits | current;
+    }
+
+    explicit WindowCounter(uint64_t window) : state(pack(window, 0, 0)) {}
+
+    // windows since the last request, 0 when a request that read the clock later already
+    // moved the stored window past ours. A key idle for 2^23 windows would look ahead, but
+    // cleanup drops it long before that.
+    uint64_t windowsSince(uint64_t bits, uint64_t window) const {
+        uint64_t moved = (window - (bits >> (2 * countBits))) & windowMask;
+        return moved > windowMask / 2 ? 0 : moved;
+    }
+
+    // window is the current window number, elapsed how far into it we are, out of length;
+    // cost is at most limit. A request whose window is behind the stored one is decided
+    // against the stored window, as if at its start, so the window never moves backwards.
+    bool tryTake(uint64_t window, uint64_t elapsed, uint64_t length, uint64_t limit, uint64_t cost) {
+        uint64_t current = state.load(memory_order_relaxed);
+        while(true) {
+            uint64_t previousCount = current >> countBits & countMask;
+            uint64_t currentCount = current & countMask;
+            uint64_t stored = current >> (2 * countBits);
+            uint64_t moved = windowsSince(current, window);
+            uint64_t at = elapsed;
+            if(moved == 0 && (stored & windowMask) != (window & windowMask)) at = 0;
+            if(moved == 1) {
+                previousCount = currentCount;
+                currentCount = 0;
+            } else if(moved > 1) {
+                previousCount = 0;
+                currentCount = 0;
+            }
+
+            if(previousCount * (length - at) / length + currentCount + cost > limit) return false;
+            if(state.compare_exchange_weak(current, pack(stored + moved, previousCount, currentCount + cost), memory_order_relaxed)) return true;
+        }
+    }
+
+    // both counts would be reset, so the key behaves like a new one
+    bool expired(uint64_t window) const { return windowsSince(state.load(memory_order_relaxed), window) > 1; }
+};
+
+// sliding-window log: the times of the last limit allowed requests in a ring. A request is
+// allowed when the oldest of them has left the window; exact, but limit timestamps per key.
+struct WindowLog {
+    mutex mux;
+    unique_ptr<uint64_t[]> times;
+    uint32_t next = 0;    // the oldest entry once the ring is full
+    uint32_t filled = 0;
+
+    explicit WindowLog(uint32_t limit) : times(make_unique<uint64_t[]>(limit)) {}
+
+    // caller holds mux; a request that read the clock before the newest one was logged
+    // counts as logged at the same time
+    uint64_t notBeforeNewest(uint64_t nowMs, uint32_t limit) const {
+        return filled == 0 ? nowMs : max(nowMs, times[next == 0 ? limit - 1 : next - 1]);
+    }
+
+    // logs cost entries, at most limit; the free slots come first after next, then the
+    // oldest entries, so the last entry overwritten has to have left the window
+    bool tryTake(uint64_t nowMs, uint64_t windowMs, uint32_t limit, uint32_t cost) {
+        lock_guard<mutex> lock(mux);
+        nowMs = notBeforeNewest(nowMs, limit);
+        if(cost > limit - filled && nowMs - times[(next + cost - 1) % limit] < windowMs) return false;
+
+        for(uint32_t i = 0; i < cost; i++) {
+            times[next] = nowMs;
+            next = next + 1 == limit ? 0 : next + 1;
+        }
+        filled = min(limit, filled + cost);
+        return true;
+    }
+
+    // every logged request has left the window
+    bool expired(uint64_t nowMs, uint64_t windowMs, uint32_t limit) {
+        lock_guard<mutex> lock(mux);
+        return filled == 0 || notBeforeNewest(nowMs, limit) - times[next == 0 ? limit - 1 : next - 1] >= windowMs;
+    }
+};
+
 class RateLimiter {
 public:
-    virtual bool isAllowed(string ip) = 0;
-    ~RateLimiter() {}
+    // takes cost tokens for key, all or none
+    virtual bool acquire(const string &key, uint32_t cost) = 0;
+
+    // decides each (key, cost) on its own, in order; allowed[i] is the decision for requests[i]
+    virtual void acquireBatch(const vector<pair<string, uint32_t>> &requests, vector<bool> &allowed) {
+        allowed.resize(requests.size());
+        for(size_t i = 0; i < requests.size(); i++) allowed[i] = acquire(requests[i].first, requests[i].second);
+    }
+
+    bool isAllowed(string ip) { return acquire(ip, 1); }
+    virtual ~RateLimiter() {}
+};
+
+// runs a sweep every period on its own thread, one bounded step at a time; destroying it
+// stops the sweep between two steps and joins the thread
+class Sweeper {
+    mutex mux;
+    condition_variable cv;
+    bool stopping = false;
+    thread worker;
+
+public:
+    // step returns false once the sweep is done
+    Sweeper(chrono::milliseconds period, function<bool()> step):
+        worker([this, period, step]{
+            unique_lock<mutex> lock(mux);
+            while(!cv.wait_for(lock, period, [this]{ return stopping; })) {
+                bool more = true;
+                while(more && !stopping) {
+                    lock.unlock();
+                    more = step();
+                    lock.lock();
+                }
+            }
+        }) {}
+
+    ~Sweeper() {
+        {
+            lock_guard<mutex> lock(mux);
+            stopping = true;
+        }
+        cv.notify_all();
+        worker.join();
+    }
+};
+
+// buckets sharded by key. A known key takes its shard's lock shared, only a new key takes
+// it exclusively. Buckets are only used under the lock, so evictStep can free them.
+template <typename B>
+class ShardedBucketMap {
+    struct alignas(64) Shard {
+        shared_mutex mux;
+        unordered_map<string, unique_ptr<B>> buckets;
+    };
+    static constexpr size_t shardCount = 64;
+    Shard shards[shardCount];
+
+    // where the sweep stopped: a shard and a slot of its hash table
+    size_t sweepShard = 0;
+    size_t sweepSlot = 0;
+
+    Shard& shardFor(const string &key) { return shards[hash<string>{}(key) % shardCount]; }
+
+public:
+    // runs use on the key's bucket, created by make first if there is none
+    template <typename Make, typename Use>
+    auto with(const string &key, Make &&make, Use &&use) {
+        Shard &shard = shardFor(key);
+        {
+            shared_lock<shared_mutex> lock(shard.mux);
+            auto it = shard.buckets.find(key);
+            if(it != shard.buckets.end()) return use(*it->second);
+        }
+
+        unique_lock<shared_mutex> lock(shard.mux);
+        unique_ptr<B> &bucket = shard.buckets[key];
+        if(!bucket) bucket = make();
+        return use(*bucket);
+    }
+
+    // runs use(i, bucket) for every requests[i], shard by shard: each shard's lock is taken
+    // shared once for the keys it has, then exclusively once more if some are new
+    template <typename Make, typename Use>
+    void withEach(const vector<pair<string, uint32_t>> &requests, Make &&make, Use &&use) {
+        vector<pair<uint32_t, uint32_t>> order(requests.size());    // (shard, request)
+        for(size_t i = 0; i < requests.size(); i++) order[i] = {hash<string>{}(requests[i].first) % shardCount, i};
+        sort(order.begin(), order.end());
+
+        vector<uint32_t> missing;
+        for(size_t begin = 0, end; begin < order.size(); begin = end) {
+            Shard &shard = shards[order[begin].first];
+            for(end = begin; end < order.size() && order[end].first == order[begin].first; end++) {}
+
+            missing.clear();
+            {
+                shared_lock<shared_mutex> lock(shard.mux);
+                for(size_t k = begin; k < end; k++) {
+                    uint32_t i = order[k].second;
+                    auto it = shard.buckets.find(requests[i].first);
+                    if(it != shard.buckets.end()) use(i, *it->second);
+                    else missing.push_back(i);
+                }
+            }
+            if(missing.empty()) continue;
+
+            unique_lock<shared_mutex> lock(shard.mux);
+            for(uint32_t i : missing) {
+                unique_ptr<B> &bucket = shard.buckets[requests[i].first];
+                if(!bucket) bucket = make();
+                use(i, *bucket);
+            }
+        }
+    }
+
+    // one step of the sweep, from one thread at a time: looks at up to maxEntries slots and
+    // entries of one shard under its shared lock, which does not block known keys, then
+    // takes it exclusively only to erase the stale ones found, checking them again first.
+    // A rehash between steps may skip an entry until the next sweep. Returns false once the
+    // sweep has been through every shard.
+    template <typename Stale>
+    bool evictStep(Stale &&isStale, size_t maxEntries = 256) {
+        Shard &shard = shards[sweepShard];
+        vector<string> stale;
+        {
+            shared_lock<shared_mutex> lock(shard.mux);
+            size_t slots = shard.buckets.bucket_count();
+            for(size_t seen = 0; sweepSlot < slots && seen < maxEntries; sweepSlot++, seen++) {
+                for(auto it = shard.buckets.begin(sweepSlot); it != shard.buckets.end(sweepSlot); ++it, seen++) {
+                    if(isStale(*it->second)) stale.push_back(it->first);
+                }
+            }
+            if(sweepSlot >= slots) {
+                sweepSlot = 0;
+                sweepShard = (sweepShard + 1) % shardCount;
+            }
+        }
+
+        if(!stale.empty()) {
+            unique_lock<shared_mutex> lock(shard.mux);
+            for(const string &key : stale) {
+                auto it = shard.buckets.find(key);
+                if(it != shard.buckets.end() && isStale(*it->second)) shard.buckets.erase(it);
+            }
+        }
+        return sweepShard != 0 || sweepSlot != 0;
+    }
 };
 
+// a request for a known ip decides with one CAS on its bucket, under a shared shard lock
 class TokenBucketRateLimiter : public RateLimiter {
-    unordered_map<string, shared_ptr<Bucket>> buckets;
+    ShardedBucketMap<Bucket> buckets;
+
+    int capacity;
+    int refillRate;
+    chrono::steady_clock::time_point startedAt;
+    // last, so it stops before the buckets go
+    Sweeper sweeper;
+
+    uint64_t nowMs() {
+        return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startedAt).count();
+    }
+
+public:
+    // capacity and rate have to fit in a bucket's token bits
+    TokenBucketRateLimiter(int cap, int rate):
+        capacity(clamp(cap, 0, Bucket::maxTokens)),
+        refillRate(clamp(rate, 0, Bucket::maxTokens)),
+        startedAt(chrono::steady_clock::now()),
+        sweeper(chrono::minutes(1), [this]{ return evictStep(); }) {}
+
+    bool acquire(const string &key, uint32_t cost) {
+        uint64_t now = nowMs();
+        return buckets.with(key,
+            [&]{ return make_unique<Bucket>(capacity, refillRate, now); },
+            [&](Bucket &bucket) { return bucket.tryTake(now, cost); });
+    }
+
+    void acquireBatch(const vector<pair<string, uint32_t>> &requests, vector<bool> &allowed) {
+        uint64_t now = nowMs();
+        allowed.resize(requests.size());
+        buckets.withEach(requests,
+            [&]{ return make_unique<Bucket>(capacity, refillRate, now); },
+            [&](uint32_t i, Bucket &bucket) { allowed[i] = bucket.tryTake(now, requests[i].second); });
+    }
+
+    // drops buckets untouched for 5 minutes, a few at a time
+    bool evictStep() {
+        uint64_t now = nowMs();
+        uint64_t staleMs = chrono::duration_cast<chrono::milliseconds>(chrono::minutes(5)).count();
+        return buckets.evictStep([&](const Bucket &bucket) { return bucket.lastRefilledMs() + staleMs < now; });
+    }
+};
+
+// the high-resolution mode: a GCRA per ip, so admission is smooth at any rate and the
+// long-run rate is refillRate, with no whole-second steps and no drift
+class GcraRateLimiter : public RateLimiter {
+    ShardedBucketMap<GcraBucket> buckets;
+
+    uint64_t capacity;
+    uint64_t interval;
+    uint64_t horizon;
+    chrono::steady_clock::time_point startedAt;
+    Sweeper sweeper;
+
+    uint64_t now() {
+        auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - startedAt).count();
+        return (uint64_t)elapsed * GcraBucket::unitsPerNs;
+    }
+
+public:
+    // refillRate tokens per second, fractions down to 0.01 allowed, and up to cap at once;
+    // a new ip starts with a full bucket. The bounds keep horizon well inside 64 bits.
+    GcraRateLimiter(int cap, double refillRate):
+        capacity(clamp(cap, 1, Bucket::maxTokens)),
+        interval((uint64_t)llround(1e9 * GcraBucket::unitsPerNs / max(refillRate, 0.01))),
+        horizon(capacity * interval),
+        startedAt(chrono::steady_clock::now()),
+        sweeper(chrono::minutes(1), [this]{ return evictStep(); }) {}
+
+    bool acquire(const string &key, uint32_t cost) {
+        if(cost > capacity) return false;
+        uint64_t at = now();
+        return buckets.with(key,
+            [&]{ return make_unique<GcraBucket>(at); },
+            [&](GcraBucket &bucket) { return bucket.tryTake(at, cost * interval, horizon); });
+    }
+
+    void acquireBatch(const vector<pair<string, uint32_t>> &requests, vector<bool> &allowed) {
+        uint64_t at = now();
+        allowed.resize(requests.size());
+        buckets.withEach(requests,
+            [&]{ return make_unique<GcraBucket>(at); },
+            [&](uint32_t i, GcraBucket &bucket) {
+                uint32_t cost = requests[i].second;
+                allowed[i] = cost <= capacity && bucket.tryTake(at, cost * interval, horizon);
+            });
+    }
+
+    // drops buckets that have been full for 5 minutes, they behave like new ones
+    bool evictStep() {
+        uint64_t at = now();
+        uint64_t staleUnits = chrono::duration_cast<chrono::nanoseconds>(chrono::minutes(5)).count() * GcraBucket::unitsPerNs;
+        return buckets.evictStep([&](const GcraBucket &bucket) { return bucket.fullSince() + staleUnits < at; });
+    }
+};
+
+// the original limiter: one global lock around the map, then the bucket's lock
+class LockedTokenBucketRateLimiter : public RateLimiter {
+    unordered_map<string, shared_ptr<LockedBucket>> buckets;
     int capacity;
     int refillRate;
     mutex mux;
-    thread cleanupThread;
+    Sweeper sweeper;
 public:
-    TokenBucketRateLimiter(int cap, int rate): 
-        capacity(cap), 
+    LockedTokenBucketRateLimiter(int cap, int rate):
+        capacity(cap),
         refillRate(rate),
-        cleanupThread(thread(&TokenBucketRateLimiter::cleanupWorker, this)) {}
+        sweeper(chrono::minutes(1), [this]{ return evictStep(); }) {}
 
-    bool isAllowed(string ip) {
-        shared_ptr<Bucket> bucket;
+    bool acquire(const string &ip, uint32_t cost) {
+        shared_ptr<LockedBucket> bucket;
         {
             lock_guard<mutex> lock(mux);
             if(buckets.find(ip) == buckets.end()) {
-                buckets[ip] = make_shared<Bucket>(capacity, refillRate);
+                buckets[ip] = make_shared<LockedBucket>(capacity, refillRate);
             }
             bucket = buckets[ip];
         }
 
-        {   
+        {
             lock_guard<mutex> lock(bucket->mux);
             // refill token if needed
-            auto now = chrono::steady_clock::now(); 
+            auto now = chrono::steady_clock::now();
             auto duration = chrono::duration_cast<chrono::seconds>(now - bucket->lastRefilledAt).count();
-            
-            if (duration > 0) { 
-                int tokensToAdd = duration * bucket->refillRate; 
-                bucket->tokens = min(bucket->capacity, bucket->tokens + tokensToAdd); 
-                bucket->lastRefilledAt = now; 
+
+            if (duration > 0) {
+                int tokensToAdd = duration * bucket->refillRate;
+                bucket->tokens = min(bucket->capacity, bucket->tokens + tokensToAdd);
+                bucket->lastRefilledAt = now;
             }
-            
-            if(bucket->tokens > 0) {
-                bucket->tokens--;
+
+            if(bucket->tokens >= (int64_t)cost) {
+                bucket->tokens -= cost;
                 return true;
             }
         }
@@ -70,36 +488,306 @@ public:
         return false;
     }
 
-    void cleanupWorker() {
-        while(true) {
-            this_thread::sleep_for(chrono::minutes(1));
+    // the original sweep, the whole map in one step
+    bool evictStep() {
+        vector<string> toDelete;
+        auto now = chrono::steady_clock::now();
 
-            vector<string> toDelete;
-            auto now = chrono::steady_clock::now();
-            
-            // identify stale buckets
-            {
-                lock_guard<mutex> lock(mux);
+        // identify stale buckets
+        {
+            lock_guard<mutex> lock(mux);
 
-                for(const auto& [ip, bucket] : buckets) {
-                    lock_guard<mutex> bLock(bucket->mux);
-                    if(bucket->lastRefilledAt + chrono::minutes(5) < now) 
-                        toDelete.push_back(ip);
-                }
+            for(const auto& [ip, bucket] : buckets) {
+                lock_guard<mutex> bLock(bucket->mux);
+                if(bucket->lastRefilledAt + chrono::minutes(5) < now)
+                    toDelete.push_back(ip);
             }
+        }
 
-            // delete stale buckets
-            {
-                lock_guard<mutex> lock(mux);
-                for(string &ip : toDelete) {
-                    buckets.erase(ip);
-                }
+        // delete stale buckets
+        {
+            lock_guard<mutex> lock(mux);
+            for(string &ip : toDelete) {
+                buckets.erase(ip);
             }
         }
+        return false;
     }
 };
 
-int main () {
+// at most limit requests per ip in any window, approximated from two fixed-window counts
+class SlidingWindowCounterRateLimiter : public RateLimiter {
+    ShardedBucketMap<WindowCounter> buckets;
+
+    uint64_t limit;
+    uint64_t windowMs;
+    chrono::steady_clock::time_point startedAt;
+    Sweeper sweeper;
+
+    uint64_t nowMs() {
+        return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startedAt).count();
+    }
+
+public:
+    SlidingWindowCounterRateLimiter(int limit, chrono::milliseconds window):
+        limit(clamp<uint64_t>(limit, 0, WindowCounter::maxCount)),
+        windowMs(max<uint64_t>(window.count(), 1)),
+        startedAt(chrono::steady_clock::now()),
+        sweeper(chrono::minutes(1), [this]{ return evictStep(); }) {}
+
+    bool acquire(const string &key, uint32_t cost) {
+        if(cost > limit) return false;
+        uint64_t now = nowMs();
+        uint64_t window = now / windowMs;
+        return buckets.with(key,
+            [&]{ return make_unique<WindowCounter>(window); },
+            [&](WindowCounter &counter) { return counter.tryTake(window, now % windowMs, windowMs, limit, cost); });
+    }
+
+    void acquireBatch(const vector<pair<string, uint32_t>> &requests, vector<bool> &allowed) {
+        uint64_t now = nowMs();
+        uint64_t window = now / windowMs;
+        allowed.resize(requests.size());
+        buckets.withEach(requests,
+            [&]{ return make_unique<WindowCounter>(window); },
+            [&](uint32_t i, WindowCounter &counter) {
+                uint32_t cost = requests[i].second;
+                allowed[i] = cost <= limit && counter.tryTake(window, now % windowMs, windowMs, limit, cost);
+            });
+    }
+
+    bool evictStep() {
+        uint64_t window = nowMs() / windowMs;
+        return buckets.evictStep([&](const WindowCounter &counter) { return counter.expired(window); });
+    }
+};
+
+// at most limit requests per ip in any window, exactly
+class SlidingWindowLogRateLimiter : public RateLimiter {
+    ShardedBucketMap<WindowLog> buckets;
+
+    uint32_t limit;
+    uint64_t windowMs;
+    chrono::steady_clock::time_point startedAt;
+    Sweeper sweeper;
+
+    uint64_t nowMs() {
+        return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startedAt).count();
+    }
+
+public:
+    SlidingWindowLogRateLimiter(int limit, chrono::milliseconds window):
+        limit(max(limit, 1)),
+        windowMs(max<uint64_t>(window.count(), 1)),
+        startedAt(chrono::steady_clock::now()),
+        sweeper(chrono::minutes(1), [this]{ return evictStep(); }) {}
+
+    bool acquire(const string &key, uint32_t cost) {
+        if(cost > limit) return false;
+        uint64_t now = nowMs();
+        return buckets.with(key,
+            [&]{ return make_unique<WindowLog>(limit); },
+            [&](WindowLog &log) { return log.tryTake(now, windowMs, limit, cost); });
+    }
+
+    void acquireBatch(const vector<pair<string, uint32_t>> &requests, vector<bool> &allowed) {
+        uint64_t now = nowMs();
+        allowed.resize(requests.size());
+        buckets.withEach(requests,
+            [&]{ return make_unique<WindowLog>(limit); },
+            [&](uint32_t i, WindowLog &log) {
+                uint32_t cost = requests[i].second;
+                allowed[i] = cost <= limit && log.tryTake(now, windowMs, limit, cost);
+            });
+    }
+
+    bool evictStep() {
+        uint64_t now = nowMs();
+        return buckets.evictStep([&](WindowLog &log) { return log.expired(now, windowMs, limit); });
+    }
+};
+
+// threads calling isAllowed over keys distinct ips, picked uniformly at random
+void benchmarkLimiter(const char *name, RateLimiter &limiter, int threads, const vector<string> &ips, int opsPerThread) {
+    atomic<uint64_t> allowed{0};
+    vector<thread> workers;
+    auto start = chrono::steady_clock::now();
+    for(int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]{
+            mt19937_64 rng(t + 1);
+            uniform_int_distribution<size_t> pick(0, ips.size() - 1);
+            uint64_t mine = 0;
+            for(int i = 0; i < opsPerThread; i++) mine += limiter.isAllowed(ips[pick(rng)]);
+            allowed += mine;
+        });
+    }
+    for(auto &w : workers) w.join();
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    uint64_t total = (uint64_t)threads * opsPerThread;
+    cout << "  " << name << " decisions/sec=" << (uint64_t)(total / seconds) << " allowed=" << allowed * 100 / total << "%\n";
+}
+
+// batches of batchSize (key, cost) pairs over random keys, decided one acquire at a time by
+// the base class and then by the limiter's own acquireBatch
+void benchmarkBatch(const char *name, RateLimiter &limiter, const vector<string> &keys, int batchSize, int batches) {
+    mt19937_64 rng(1);
+    uniform_int_distribution<size_t> pick(0, keys.size() - 1);
+    vector<vector<pair<string, uint32_t>>> requests(batches);
+    for(auto &batch : requests) {
+        for(int i = 0; i < batchSize; i++) batch.push_back({keys[pick(rng)], (uint32_t)(1 + rng() % 4)});
+    }
+
+    // every bucket exists before either run; cost 0 takes nothing
+    for(const string &key : keys) limiter.acquire(key, 0);
+
+    vector<bool> allowed;
+    for(int batched = 0; batched < 2; batched++) {
+        uint64_t admitted = 0;
+        auto start = chrono::steady_clock::now();
+        for(auto &batch : requests) {
+            if(batched) limiter.acquireBatch(batch, allowed);
+            else limiter.RateLimiter::acquireBatch(batch, allowed);
+            for(bool ok : allowed) admitted += ok;
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        uint64_t total = (uint64_t)batches * batchSize;
+        cout << "  " << name << (batched ? " acquireBatch" : " acquire loop") << " decisions/sec=" << (uint64_t)(total / seconds)
+             << " allowed=" << admitted * 100 / total << "%\n";
+    }
+}
+
+// one ip hammered for seconds: the admitted rate against the configured one, and the
+// fewest and most requests admitted in any 100ms slot
+void benchmarkRate(const char *name, RateLimiter &limiter, int rate, int seconds) {
+    vector<uint64_t> slots(seconds * 10);
+    auto start = chrono::steady_clock::now();
+    while(true) {
+        auto slot = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count() / 100;
+        if(slot >= (long long)slots.size()) break;
+        slots[slot] += limiter.isAllowed("10.0.0.1");
+    }
+
+    uint64_t allowed = 0;
+    for(uint64_t n : slots) allowed += n;
+    // the first slot holds the initial burst
+    auto [fewest, most] = minmax_element(slots.begin() + 1, slots.end());
+    cout << "  " << name << " admitted/sec=" << allowed / seconds << " (configured " << rate << ")"
+         << " per 100ms min=" << *fewest << " max=" << *most << "\n";
+}
+
+size_t currentRssBytes() {
+#ifdef __APPLE__
+    mach_task_basic_info info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if(task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) != KERN_SUCCESS) return 0;
+    return info.resident_size;
+#else
+    size_t pages = 0, residentPages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if(!f) return 0;
+    if(fscanf(f, "%zu %zu", &pages, &residentPages) != 2) residentPages = 0;
+    fclose(f);
+    return residentPages * sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// memory per key once every ip has a bucket, then the latency of single decisions over
+// random ips; runs in a child process so that no limiter inherits another's heap
+void reportFootprint(const char *name, const function<RateLimiter*()> &make, const vector<string> &ips, int ops) {
+    cout.flush();
+    pid_t pid = fork();
+    if(pid != 0) {
+        waitpid(pid, nullptr, 0);
+        return;
+    }
+
+    size_t before = currentRssBytes();
+    // never freed, the child exits
+    RateLimiter &limiter = *make();
+    for(const string &ip : ips) limiter.isAllowed(ip);
+    size_t after = currentRssBytes();
+
+    mt19937_64 rng(1);
+    uniform_int_distribution<size_t> pick(0, ips.size() - 1);
+    vector<uint64_t> latencies(ops);
+    for(int i = 0; i < ops; i++) {
+        const string &ip = ips[pick(rng)];
+        auto start = chrono::steady_clock::now();
+        limiter.isAllowed(ip);
+        latencies[i] = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    }
+    uint64_t total = 0;
+    for(uint64_t ns : latencies) total += ns;
+    sort(latencies.begin(), latencies.end());
+
+    cout << "  " << name << ": " << (after - before) / ips.size() << " bytes/key"
+         << " latency mean=" << total / ops << "ns p50=" << latencies[ops / 2] << "ns p99=" << latencies[ops * 99 / 100] << "ns\n";
+    cout.flush();
+    _exit(0);
+}
+
+int main(int argc, char* argv[]) {
+    string mode = argc > 1 ? argv[1] : "";
+
+    if(mode == "bench") {
+        // ./main bench [threads] [keys] [opsPerThread]
+        int threads = argc > 2 ? stoi(argv[2]) : 4;
+        int keys = argc > 3 ? max(1, stoi(argv[3])) : 10000;
+        int opsPerThread = argc > 4 ? stoi(argv[4]) : 1000000;
+        cout << "threads=" << threads << " keys=" << keys << " opsPerThread=" << opsPerThread << "\n";
+
+        vector<string> ips;
+        for(int i = 0; i < keys; i++) ips.push_back("10." + to_string(i >> 16 & 255) + "." + to_string(i >> 8 & 255) + "." + to_string(i & 255));
+        benchmarkLimiter("locked", *make_unique<LockedTokenBucketRateLimiter>(100, 50), threads, ips, opsPerThread);
+        benchmarkLimiter("atomic", *make_unique<TokenBucketRateLimiter>(100, 50), threads, ips, opsPerThread);
+        benchmarkLimiter("gcra", *make_unique<GcraRateLimiter>(100, 50), threads, ips, opsPerThread);
+        return 0;
+    }
+
+    if(mode == "bench-footprint") {
+        // ./main bench-footprint [keys] [ops] [limit per second]
+        int keys = argc > 2 ? max(1, stoi(argv[2])) : 1000000;
+        int ops = argc > 3 ? max(1, stoi(argv[3])) : 1000000;
+        int limit = argc > 4 ? max(1, stoi(argv[4])) : 10;
+        cout << "keys=" << keys << " ops=" << ops << " limit=" << limit << "/s\n";
+
+        vector<string> ips;
+        for(int i = 0; i < keys; i++) ips.push_back("10." + to_string(i >> 16 & 255) + "." + to_string(i >> 8 & 255) + "." + to_string(i & 255));
+        reportFootprint("token bucket", [&]() -> RateLimiter* { return new TokenBucketRateLimiter(limit, limit); }, ips, ops);
+        reportFootprint("gcra", [&]() -> RateLimiter* { return new GcraRateLimiter(limit, limit); }, ips, ops);
+        reportFootprint("sliding window counter", [&]() -> RateLimiter* { return new SlidingWindowCounterRateLimiter(limit, chrono::seconds(1)); }, ips, ops);
+        reportFootprint("sliding window log", [&]() -> RateLimiter* { return new SlidingWindowLogRateLimiter(limit, chrono::seconds(1)); }, ips, ops);
+        return 0;
+    }
+
+    if(mode == "bench-batch") {
+        // ./main bench-batch [batchSize] [keys] [batches]
+        int batchSize = argc > 2 ? max(1, stoi(argv[2])) : 3;
+        int keys = argc > 3 ? max(1, stoi(argv[3])) : 100000;
+        int batches = argc > 4 ? max(1, stoi(argv[4])) : 1000000 / batchSize;
+        cout << "batchSize=" << batchSize << " keys=" << keys << " batches=" << batches << "\n";
+
+        vector<string> ips;
+        for(int i = 0; i < keys; i++) ips.push_back("10." + to_string(i >> 16 & 255) + "." + to_string(i >> 8 & 255) + "." + to_string(i & 255));
+        benchmarkBatch("atomic", *make_unique<TokenBucketRateLimiter>(1000, 1000), ips, batchSize, batches);
+        benchmarkBatch("gcra", *make_unique<GcraRateLimiter>(1000, 1000), ips, batchSize, batches);
+        benchmarkBatch("sliding window counter", *make_unique<SlidingWindowCounterRateLimiter>(1000, chrono::seconds(1)), ips, batchSize, batches);
+        return 0;
+    }
+
+    if(mode == "bench-rate") {
+        // ./main bench-rate [rate] [seconds]
+        int rate = argc > 2 ? max(1, stoi(argv[2])) : 20000;
+        int seconds = argc > 3 ? max(2, stoi(argv[3])) : 5;
+        int capacity = max(1, rate / 100);
+        cout << "rate=" << rate << "/s capacity=" << capacity << " seconds=" << seconds << "\n";
+
+        benchmarkRate("atomic", *make_unique<TokenBucketRateLimiter>(capacity, rate), rate, seconds);
+        benchmarkRate("gcra", *make_unique<GcraRateLimiter>(capacity, rate), rate, seconds);
+        return 0;
+    }
+
     cout << "Main:: rate limitter\n";
     TokenBucketRateLimiter rateLimiter(5, 2); // 5 requests capacity, 1 request per second refill
     string testIp = "192.168.1.1";
@@ -112,4 +800,4 @@ int main () {
         this_thread::sleep_for(chrono::milliseconds(300));
     }
     return 0;
-}
\ No newline at end of file
+}